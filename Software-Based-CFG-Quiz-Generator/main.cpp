@@ -10,919 +10,5362 @@
 #include <chrono>
 #include <set>
 #include <queue>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <cstdlib>
+#include <bitset>
+#include <unordered_set>
+#include <unordered_map>
+#include <cctype>
+#include <memory>
+#include <functional>
+#include <cstdio>
+#include <future>
+#include <cmath>
+#include <condition_variable>
+#include <climits>
+#include <cstring>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "static_cfg.h"
 
 using namespace std;
 
-void replaceStringWithVector(vector<string>& mainVec, const string& toFind,string& replacementVec)                    
+// ---------------------------------------------------------------------------------------------
+// Metrics. Build with -DCFG_METRICS to enable; otherwise every METRIC_* macro compiles to nothing.
+// Each thread updates its own block with relaxed atomics (no locking on the hot path); a dump
+// sums all live blocks plus the totals of threads that already exited.
+// ---------------------------------------------------------------------------------------------
+
+enum MetricCounter
 {
-    auto it = find(mainVec.begin(), mainVec.end(), toFind);
-    if (it != mainVec.end()) 
-    {
-        it = mainVec.erase(it);
-        mainVec.insert(it, replacementVec);
-    }
-}
+    M_GEN_CALLS,
+    M_GEN_RETRIES,
+    M_TYPE1_RETRIES,
+    M_TYPE2_RETRIES,
+    M_EARLEY_CALLS,
+    M_BFS_CALLS,
+    M_BFS_NODES,
+    M_FILE_LOADS,
+    M_GRAMMARS_LOADED,
+    M_QUESTION_FALLBACKS,
+    M_PREFILTER_REJECTS,
+    M_COUNTER_COUNT
+};
 
-struct Production 
+enum MetricHistogram
 {
-    string lhs;
-    vector<string> rhs; // Each rule is a sequence of symbols (terminals or non-terminals) 
+    H_GEN_RETRIES,
+    H_TYPE1_RETRIES,
+    H_TYPE2_RETRIES,
+    H_EARLEY_CHART_STATES,
+    H_BFS_QUEUE_PEAK,
+    H_GEN_US,
+    H_EARLEY_US,
+    H_BFS_US,
+    H_LOAD_US,
+    H_TYPE1_US,
+    H_TYPE2_US,
+    H_TYPE3_US,
+    H_TYPE4_US,
+    H_HISTOGRAM_COUNT
 };
 
-class CFG {
-private:
-    map<string, Production> rules;
-    string startSymbol;
-    string augmentedStart;
+const char* const metricCounterNames[M_COUNTER_COUNT] =
+{
+    "cfg_generate_calls_total",
+    "cfg_generate_retries_total",
+    "quiz_type1_retries_total",
+    "quiz_type2_retries_total",
+    "cfg_earley_calls_total",
+    "cfg_bfs_calls_total",
+    "cfg_bfs_nodes_total",
+    "bank_file_loads_total",
+    "bank_grammars_loaded_total",
+    "quiz_question_fallbacks_total",
+    "cfg_prefilter_rejects_total"
+};
 
-    struct State 
+const char* const metricHistogramNames[H_HISTOGRAM_COUNT] =
+{
+    "cfg_generate_retries",
+    "quiz_type1_retries",
+    "quiz_type2_retries",
+    "cfg_earley_chart_states",
+    "cfg_bfs_queue_peak",
+    "cfg_generate_us",
+    "cfg_earley_us",
+    "cfg_bfs_us",
+    "bank_load_us",
+    "quiz_type1_us",
+    "quiz_type2_us",
+    "quiz_type3_us",
+    "quiz_type4_us"
+};
+
+const int METRIC_BUCKETS = 32; // bucket b counts values v with bit_width(v) == b, i.e. [2^(b-1), 2^b)
+
+struct TraceEvent
+{
+    const char* name;
+    long long startUs;
+    long long durUs;
+    int arg; // grammar index or -1
+};
+
+struct MetricBlock
+{
+    atomic<uint64_t> counters[M_COUNTER_COUNT] = {};
+    atomic<uint64_t> buckets[H_HISTOGRAM_COUNT][METRIC_BUCKETS] = {};
+    atomic<uint64_t> sums[H_HISTOGRAM_COUNT] = {};
+    atomic<uint64_t> counts[H_HISTOGRAM_COUNT] = {};
+    mutex traceLock; // only taken when tracing is on
+    vector<TraceEvent> trace;
+    unsigned tid = 0;
+
+    static void bump(atomic<uint64_t>& a, uint64_t v)
     {
-        string lhs;
-        vector<string> rhs;
-        int dot;
-        int start;
-        bool operator<(State const &other) const 
+        a.store(a.load(memory_order_relaxed) + v, memory_order_relaxed); // single writer
+    }
+
+    void add(MetricCounter c, uint64_t v) { bump(counters[c], v); }
+
+    void observe(MetricHistogram h, uint64_t v)
+    {
+        int b = 0;
+        while (b < METRIC_BUCKETS - 1 && (v >> b) != 0) b++;
+        bump(buckets[h][b], 1);
+        bump(sums[h], v);
+        bump(counts[h], 1);
+    }
+
+    void mergeInto(MetricBlock& total)
+    {
+        for (int c = 0; c < M_COUNTER_COUNT; c++) total.counters[c] += counters[c].load(memory_order_relaxed);
+        for (int h = 0; h < H_HISTOGRAM_COUNT; h++)
         {
-            if (lhs != other.lhs) return lhs < other.lhs;
-            if (rhs != other.rhs) return rhs < other.rhs;
-            if (dot != other.dot) return dot < other.dot;
-            return start < other.start;
+            for (int b = 0; b < METRIC_BUCKETS; b++) total.buckets[h][b] += buckets[h][b].load(memory_order_relaxed);
+            total.sums[h] += sums[h].load(memory_order_relaxed);
+            total.counts[h] += counts[h].load(memory_order_relaxed);
         }
-    };
+    }
+};
 
-public:
-    CFG(const string& start) : startSymbol(start)  // reminder to modify filling so that augmentedStart is accounted for
+struct MetricRegistry
+{
+    mutex lock;
+    vector<MetricBlock*> live;
+    MetricBlock retired;
+    vector<TraceEvent> retiredTrace;
+    vector<unsigned> retiredTids;
+    unsigned nextTid = 1;
+    atomic<bool> tracing{false};
+    chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+};
+
+MetricRegistry& metricRegistry()
+{
+    static MetricRegistry* reg = new MetricRegistry; // never destroyed: thread exit and atexit may still report
+    return *reg;
+}
+
+struct MetricThreadSlot
+{
+    MetricBlock block;
+
+    MetricThreadSlot()
     {
-        augmentedStart = startSymbol + "'";
-        rules[augmentedStart] = {augmentedStart, {startSymbol}};
+        MetricRegistry& reg = metricRegistry();
+        lock_guard<mutex> g(reg.lock);
+        block.tid = reg.nextTid++;
+        reg.live.push_back(&block);
     }
 
-    void addRule(const string& lhs, const vector<string>& alternatives) 
+    ~MetricThreadSlot()
     {
-        rules[lhs] = { lhs, alternatives };
+        MetricRegistry& reg = metricRegistry();
+        lock_guard<mutex> g(reg.lock);
+        block.mergeInto(reg.retired);
+        for (auto& ev : block.trace)
+        {
+            reg.retiredTrace.push_back(ev);
+            reg.retiredTids.push_back(block.tid);
+        }
+        reg.live.erase(find(reg.live.begin(), reg.live.end(), &block));
     }
+};
+
+MetricBlock& metricsLocal()
+{
+    thread_local MetricThreadSlot slot;
+    return slot.block;
+}
+
+long long metricNowUs()
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - metricRegistry().epoch).count();
+}
 
-    string generateString(int maxDepth = 5) 
+// Times a scope into a histogram and, when tracing is on, records a Chrome trace "X" event.
+// finish() ends the span early, e.g. before a question waits on the student.
+class MetricSpan
+{
+public:
+    MetricSpan(const char* name, MetricHistogram h, int arg = -1) : name(name), hist(h), arg(arg), start(metricNowUs()) {}
+
+    ~MetricSpan() { finish(); }
+
+    void finish()
     {
-        string result;
-        map<string,Production> checked;
-        vector<string> symbols;
-        try_again:
-        symbols = {startSymbol};
-        result = derive(symbols, checked, maxDepth);
-        if(result == "E")
+        if (done) return;
+        done = true;
+        long long dur = metricNowUs() - start;
+        MetricBlock& b = metricsLocal();
+        b.observe(hist, dur);
+        if (metricRegistry().tracing.load(memory_order_relaxed))
         {
-            symbols.clear();
-            checked.clear();
-            goto try_again;
+            lock_guard<mutex> g(b.traceLock);
+            b.trace.push_back({name, start, dur, arg});
         }
-        
-        return result;
     }
 
-    bool isValidString(const string& input) 
-    {
-        int n = input.size();
-        vector< set<State> > chart(n+1);
-        vector< queue<State> > work(n+1);
+private:
+    const char* name;
+    MetricHistogram hist;
+    int arg;
+    long long start;
+    bool done = false;
+};
 
-        auto addState = [&](int idx, State const &st) 
-        {
-            if (!chart[idx].count(st)) 
-            {
-                chart[idx].insert(st);
-                work[idx].push(st);
-            }
-        };
+#ifdef CFG_METRICS
+#define METRIC_INC(c) metricsLocal().add(c, 1)
+#define METRIC_ADD(c, v) metricsLocal().add(c, (uint64_t)(v))
+#define METRIC_OBSERVE(h, v) metricsLocal().observe(h, (uint64_t)(v))
+#define METRIC_SPAN(name, h, ...) MetricSpan metric_span(name, h, ##__VA_ARGS__)
+#define METRIC_SPAN_END() metric_span.finish()
+#else
+#define METRIC_INC(c) ((void)0)
+#define METRIC_ADD(c, v) ((void)0)
+#define METRIC_OBSERVE(h, v) ((void)0)
+#define METRIC_SPAN(name, h, ...) ((void)0)
+#define METRIC_SPAN_END() ((void)0)
+#endif
 
-        vector<string> initRhs = tokenize(rules[augmentedStart].rhs[0]);
-        addState(0, State{augmentedStart, initRhs, 0, 0});
+MetricBlock& metricSnapshot(MetricBlock& total)
+{
+    MetricRegistry& reg = metricRegistry();
+    lock_guard<mutex> g(reg.lock);
+    reg.retired.mergeInto(total);
+    for (MetricBlock* b : reg.live) b->mergeInto(total);
+    return total;
+}
 
-        for (int i = 0; i <= n; ++i)
+void dumpMetricsPrometheus(ostream& os)
+{
+    MetricBlock total;
+    metricSnapshot(total);
+    for (int c = 0; c < M_COUNTER_COUNT; c++)
+    {
+        os << "# TYPE " << metricCounterNames[c] << " counter\n";
+        os << metricCounterNames[c] << " " << total.counters[c].load() << "\n";
+    }
+    for (int h = 0; h < H_HISTOGRAM_COUNT; h++)
+    {
+        const char* name = metricHistogramNames[h];
+        os << "# TYPE " << name << " histogram\n";
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++)
         {
-            while (!work[i].empty()) 
-            {
-                State s = work[i].front(); 
-                work[i].pop();
-                if (s.dot < (int)s.rhs.size()) 
-                {
-                    string nextSym = s.rhs[s.dot];
-                    if (rules.count(nextSym))
-                    {
-                        for (auto &alt : rules[nextSym].rhs) 
-                        {
-                            vector<string> tokens = tokenize(alt);
-                            addState(i, State{nextSym, tokens, 0, i});
-                        }
-                    }
-                    else if (i < n && nextSym.size() == 1 && input[i] == nextSym[0]) 
-                    {
-                        State scan = s;
-                        scan.dot++;
-                        addState(i+1, scan);
-                    }
-                } 
-                else 
-                {
-                    for (auto &st2 : chart[s.start]) 
-                    {
-                        if (st2.dot < (int)st2.rhs.size() && st2.rhs[st2.dot] == s.lhs) 
-                        {
-                            State comp = st2;
-                            comp.dot++;
-                            addState(i, comp);
-                        }
-                    }
-                }
-            }
+            cumulative += total.buckets[h][b].load();
+            if (b == METRIC_BUCKETS - 1) os << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+            else os << name << "_bucket{le=\"" << ((1ull << b) - 1) << "\"} " << cumulative << "\n";
         }
+        os << name << "_sum " << total.sums[h].load() << "\n";
+        os << name << "_count " << total.counts[h].load() << "\n";
+    }
+}
 
-        vector<string> finalRhs = tokenize(rules[augmentedStart].rhs[0]);
-        State finalState{augmentedStart, finalRhs, 1, 0};
-        return chart[n].count(finalState) > 0;
+void dumpMetricsJson(ostream& os)
+{
+    MetricBlock total;
+    metricSnapshot(total);
+    os << "{\n  \"counters\": {";
+    for (int c = 0; c < M_COUNTER_COUNT; c++)
+    {
+        os << (c ? "," : "") << "\n    \"" << metricCounterNames[c] << "\": " << total.counters[c].load();
+    }
+    os << "\n  },\n  \"histograms\": {";
+    for (int h = 0; h < H_HISTOGRAM_COUNT; h++)
+    {
+        os << (h ? "," : "") << "\n    \"" << metricHistogramNames[h] << "\": {\"count\": " << total.counts[h].load()
+           << ", \"sum\": " << total.sums[h].load() << ", \"buckets\": [";
+        for (int b = 0; b < METRIC_BUCKETS; b++) os << (b ? "," : "") << total.buckets[h][b].load();
+        os << "]}";
     }
+    os << "\n  }\n}\n";
+}
 
-    vector<string> deriveLeftmost(const string& input) 
+// Chrome trace-event JSON, loadable in chrome://tracing or Perfetto.
+void dumpTraceEvents(ostream& os)
+{
+    MetricRegistry& reg = metricRegistry();
+    lock_guard<mutex> g(reg.lock);
+    bool first = true;
+    auto emit = [&](const TraceEvent& ev, unsigned tid)
     {
-        using Form = vector<string>;
-        struct Node { Form form; vector<Form> path; };
-        auto tokenize = [&](const string &alt) 
-        {
-            Form t;
-            for (char c: alt) t.push_back(string(1, c));
-            return t;
-        };
-        string target = input;
-        Form start = { startSymbol };
-        queue<Node> q;
-        set<string> seen;
-        q.push({ start, { start } });
-        seen.insert(startSymbol + " ");
+        os << (first ? "\n" : ",\n") << "{\"name\":\"" << ev.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+           << ",\"ts\":" << ev.startUs << ",\"dur\":" << ev.durUs;
+        if (ev.arg >= 0) os << ",\"args\":{\"grammar\":" << ev.arg << "}";
+        os << "}";
+        first = false;
+    };
+    os << "{\"traceEvents\":[";
+    for (size_t i = 0; i < reg.retiredTrace.size(); i++) emit(reg.retiredTrace[i], reg.retiredTids[i]);
+    for (MetricBlock* b : reg.live)
+    {
+        lock_guard<mutex> tg(b->traceLock);
+        for (auto& ev : b->trace) emit(ev, b->tid);
+    }
+    os << "\n]}\n";
+}
 
-        while (!q.empty()) 
-        {
-            Node cur = q.front(); q.pop();
+void replaceStringWithVector(vector<string>& mainVec, const string& toFind,string& replacementVec)                    
+{
+    auto it = find(mainVec.begin(), mainVec.end(), toFind);
+    if (it != mainVec.end()) 
+    {
+        it = mainVec.erase(it);
+        mainVec.insert(it, replacementVec);
+    }
+}
 
-            string s;
-            for (auto &sym : cur.form) s += sym;
-            if (s == target) 
-            {
-                vector<string> deriv;
-                for (auto &f : cur.path) {
-                    string tmp;
-                    for (auto &sym : f) tmp += sym;
-                    deriv.push_back(tmp);
-                }
-                return deriv;
-            }
+struct Production 
+{
+    string lhs;
+    vector<string> rhs; // Each rule is a sequence of symbols (terminals or non-terminals)
+};
 
-            for (int i = 0; i < (int)cur.form.size(); ++i) 
-            {
-                string sym = cur.form[i];
-                if (rules.count(sym)) 
-                {
-                    for (auto &alt : rules[sym].rhs) 
-                    {
-                        Form next;
-                        next.insert(next.end(), cur.form.begin(), cur.form.begin() + i);
+// Every random choice behind a question is drawn from this per-thread generator, so a thread
+// that seeds it replays the same questions (see Load_Test).
+mt19937& quizRandom()
+{
+    thread_local mt19937 gen(random_device{}());
+    return gen;
+}
 
-                        Form tok = tokenize(alt);
-                        next.insert(next.end(), tok.begin(), tok.end());
+// Set by the load test: budgets stop on steps only, and background question builds run at a
+// fixed point instead of racing the session, so a seed reproduces a run exactly.
+bool reproducibleRuns = false;
 
-                        next.insert(next.end(), cur.form.begin() + i + 1, cur.form.end());
-                        
-                        string key;
-                        for (auto &x : next) key += x + " ";
-                        if (seen.insert(key).second) 
-                        {
-                            auto newPath = cur.path;
-                            newPath.push_back(next);
-                            q.push({ next, newPath });
-                        }
-                    }
-                    break;
-                }
-            }
-        }   
-        return {};
+enum class OpStatus { Ok, BudgetExceeded, Cancelled };
+
+// Deadline, step budget and cancellation flag for the expensive CFG operations.
+// A default-constructed Budget never runs out.
+struct Budget
+{
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    long long maxSteps = -1; // < 0 means unlimited
+    long long steps = 0;
+    const atomic<bool>* cancel = nullptr;
+    OpStatus status = OpStatus::Ok;
+
+    static Budget forMillis(long long ms, long long stepLimit = -1, const atomic<bool>* token = nullptr)
+    {
+        Budget b;
+        if (!reproducibleRuns) b.deadline = chrono::steady_clock::now() + chrono::milliseconds(ms);
+        b.maxSteps = stepLimit;
+        b.cancel = token;
+        return b;
     }
 
-    vector<string> deriveRightmost(const string& input) 
+    // Charges n units of work. Returns false (and keeps returning false) once the step budget,
+    // the deadline or the cancellation token says stop; the clock is only read every 64 steps.
+    bool step(long long n = 1)
     {
-        using Form = vector<string>;
-        struct Node { Form form; vector<Form> path; };
-        auto tokenize = [&](const string &alt) {
-            Form t;
-            for (char c: alt) t.push_back(string(1, c));
-            return t;
-        };
-        string target = input;
-        Form start = { startSymbol };
-        queue<Node> q;
-        set<string> seen;
-        q.push({ start, { start } });
+        if (status != OpStatus::Ok) return false;
+        steps += n;
+        if (maxSteps >= 0 && steps > maxSteps) status = OpStatus::BudgetExceeded;
+        else if (cancel && cancel->load(memory_order_relaxed)) status = OpStatus::Cancelled;
+        else if ((sinceClock += n) >= 64)
+        {
+            sinceClock = 0;
+            if (chrono::steady_clock::now() >= deadline) status = OpStatus::BudgetExceeded;
+        }
+        return status == OpStatus::Ok;
+    }
 
-        string initKey;
-        for (auto &x: start) initKey += x + " ";
-        seen.insert(initKey);
+    bool exhausted() const { return status != OpStatus::Ok; }
 
-        while (!q.empty()) {
-            Node cur = q.front(); q.pop();
+private:
+    long long sinceClock = 0;
+};
 
-            string s;
-            for (auto &sym : cur.form) s += sym;
-            if (s == target) {
-                vector<string> deriv;
-                for (auto &f : cur.path) {
-                    string tmp;
-                    for (auto &sym : f) tmp += sym;
-                    deriv.push_back(tmp);
-                }
-                return deriv;
-            }
+template <class T>
+struct OpResult
+{
+    OpStatus status;
+    T value;
+    bool ok() const { return status == OpStatus::Ok; }
+};
+
+// ---------------------------------------------------------------------------------------------
+// Result cache. Membership checks and derivations are pure functions of (grammar, input), and a
+// quiz asks about the same short strings over and over. Entries are keyed by the grammar's content
+// hash rather than its address, so they stay valid when an unchanged grammar is reloaded into a
+// new bank snapshot. The cache is split into shards, each with its own lock and CLOCK hand.
+// ---------------------------------------------------------------------------------------------
+
+// 64-bit FNV-1a, chained through h.
+uint64_t fnv1a(const string& s, uint64_t h = 1469598103934665603ULL)
+{
+    for (unsigned char c : s)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-            for (int i = (int)cur.form.size() - 1; i >= 0; --i) {
-                string sym = cur.form[i];
-                if (rules.count(sym)) {
+struct CachedResult
+{
+    bool valid = false;         // CACHE_VALIDITY
+    vector<string> derivation;  // CACHE_LEFTMOST, CACHE_RIGHTMOST
+    long long steps = 0;        // budget the computation used; charged again on a hit
+};
 
-                    for (auto &alt : rules[sym].rhs) {
-                        Form next;
+enum CacheOp : uint8_t { CACHE_VALIDITY, CACHE_LEFTMOST, CACHE_RIGHTMOST };
 
-                        next.insert(next.end(), cur.form.begin(), cur.form.begin() + i);
- 
-                        Form tok = tokenize(alt);
-                        next.insert(next.end(), tok.begin(), tok.end());
+const size_t RESULT_CACHE_SHARDS = 16;
+const size_t RESULT_CACHE_ENTRIES = 16384;   // across all shards
+const size_t RESULT_CACHE_MAX_INPUT = 32;    // longer inputs are rarely repeated; not cached
 
-                        next.insert(next.end(), cur.form.begin() + i + 1, cur.form.end());
+class ResultCache
+{
+public:
+    struct Stats { uint64_t hits = 0, misses = 0, evictions = 0, entries = 0; };
 
-                        string key;
-                        for (auto &x : next) key += x + " ";
-                        if (seen.insert(key).second) {
-                            auto newPath = cur.path;
-                            newPath.push_back(next);
-                            q.push({ next, newPath });
-                        }
-                    }
-                    break;
-                }
-            }
+    bool lookup(uint64_t grammar, CacheOp op, const string& input, CachedResult& out)
+    {
+        if (input.size() > RESULT_CACHE_MAX_INPUT) return false;
+        Key key{grammar, op, input};
+        Shard& s = shardFor(key);
+        lock_guard<mutex> lock(s.lock);
+        auto found = s.where.find(key);
+        if (found == s.where.end())
+        {
+            s.misses++;
+            return false;
         }
-        return {};
+        Entry& e = s.slots[found->second];
+        e.referenced = true;
+        out = e.value;
+        s.hits++;
+        return true;
     }
 
-private:
-    string derive(vector<string>& symbols, map<string,Production>& checked, int depth)
+    void store(uint64_t grammar, CacheOp op, const string& input, const CachedResult& value)
     {
-        //srand(time(NULL));
-        int E_counter[3] = {0};
-        std::random_device rd;
-        if (depth < 0)
-        {   
-            for (string& sym : symbols)
-            {
-                if (isNonTerminal(sym)) return "E"; // failed derivation
-            }
-            string result;
-            for (string& sym : symbols) result += sym;
-            return result; // case: To be Cecked;
+        if (input.size() > RESULT_CACHE_MAX_INPUT) return;
+        Key key{grammar, op, input};
+        Shard& s = shardFor(key);
+        lock_guard<mutex> lock(s.lock);
+        auto found = s.where.find(key);
+        if (found != s.where.end())
+        {
+            s.slots[found->second].value = value;
+            return;
         }
-
-        int flag = 1;
-        vector<string> toDerive;
-        string result;
-        for(string& sys: symbols)
+        size_t slot;
+        if (s.slots.size() < RESULT_CACHE_ENTRIES / RESULT_CACHE_SHARDS)
         {
-            if(isNonTerminal(sys)) 
-            { 
-                flag = 0;
-                depth--;
-                toDerive.push_back(sys);
-            }
+            slot = s.slots.size();
+            s.slots.push_back(Entry());
         }
-
-        if(flag == 1) // case where no non-terminals in symbols
+        else
         {
-            for(string& sys: symbols)
+            // CLOCK: recently hit entries get a second chance, the first cold one is replaced.
+            while (s.slots[s.hand].referenced)
             {
-                result += sys;
+                s.slots[s.hand].referenced = false;
+                s.hand = (s.hand + 1) % s.slots.size();
             }
-            return result;
+            slot = s.hand;
+            s.hand = (s.hand + 1) % s.slots.size();
+            s.where.erase(s.slots[slot].key);
+            s.evictions++;
         }
+        s.slots[slot] = Entry{key, value, false};
+        s.where[key] = slot;
+    }
 
-        // Try to build the result symbol by symbol
-        string test;
-        
-        for(string& sym : toDerive)
+    Stats stats()
+    {
+        Stats total;
+        for (Shard& s : shards)
         {
-            sos:
-            if(E_counter[0] >= 10 || E_counter[1] >= 10 || E_counter[2] >= 10)
+            lock_guard<mutex> lock(s.lock);
+            total.hits += s.hits;
+            total.misses += s.misses;
+            total.evictions += s.evictions;
+            total.entries += s.slots.size();
+        }
+        return total;
+    }
+
+private:
+    struct Key
+    {
+        uint64_t grammar;
+        CacheOp op;
+        string input;
+        bool operator==(const Key& o) const { return grammar == o.grammar && op == o.op && input == o.input; }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key& k) const { return fnv1a(k.input, k.grammar ^ (uint64_t(k.op) << 56)); }
+    };
+    struct Entry
+    {
+        Key key;
+        CachedResult value;
+        bool referenced = false;
+    };
+    struct Shard
+    {
+        mutex lock;
+        vector<Entry> slots;
+        unordered_map<Key, size_t, KeyHash> where;
+        size_t hand = 0;
+        uint64_t hits = 0, misses = 0, evictions = 0;
+    };
+
+    Shard shards[RESULT_CACHE_SHARDS];
+
+    Shard& shardFor(const Key& k) { return shards[(KeyHash()(k) >> 32) % RESULT_CACHE_SHARDS]; }
+};
+
+ResultCache resultCache;
+
+// Constraints for CFG::generateConstrained. Every field is optional; the defaults accept any string up to maxLength.
+struct GenConstraints
+{
+    int minLength = 0;
+    int maxLength = 8;
+    string prefix;
+    string suffix;
+    vector<string> required; // substrings that must occur (a single character means a required terminal)
+    string forbidden;        // terminals that must not occur
+};
+
+// Samples strings of a grammar that satisfy a GenConstraints without generate-and-filter.
+// The grammar is normalized (no empty or unit rules), intersected with a small DFA for the
+// constraint, and a counting DP over (non-terminal, length, dfa state in, dfa state out)
+// drives the choice of every alternative, so each sample costs one top-down walk.
+class ConstrainedSampler
+{
+public:
+    ConstrainedSampler(const map<string, Production>& rules, const string& start, const GenConstraints& c)
+    {
+        minLen = max(0, c.minLength);
+        maxLen = max(minLen, c.maxLength);
+        if (!normalize(rules, start)) return;
+        if (!buildAutomaton(c)) return;
+        if (!buildCounts()) return;
+        ready = true;
+    }
+
+    // Number of derivations (of the normalized grammar) that satisfy the constraints.
+    double count() const
+    {
+        if (!ready) return 0;
+        double total = emptyAllowed() ? 1 : 0;
+        for (int n = max(1, minLen); n <= maxLen; n++)
+        {
+            for (int q = 0; q < Q; q++)
             {
-                return "E";
+                if (accepting[q]) total += ntCount[ntIdx(startNT, n, 0, q)];
             }
-            test = rules[sym].rhs[rd() % rules[sym].rhs.size()];
-            if(test == "" && depth > 0)
+        }
+        return total;
+    }
+
+    // Number of derivations of strings of exactly length n (n within the constructed range).
+    double countOfLength(int n) const
+    {
+        if (!ready || n < minLen || n > maxLen) return 0;
+        if (n == 0) return emptyAllowed() ? 1 : 0;
+        double total = 0;
+        for (int q = 0; q < Q; q++)
+        {
+            if (accepting[q]) total += ntCount[ntIdx(startNT, n, 0, q)];
+        }
+        return total;
+    }
+
+    // Set when the sampler gave up: the grammar cannot be normalized exactly, or the automaton or
+    // counting table is over its size limit. count() is then 0 without meaning "unsatisfiable".
+    const string& rejected() const { return rejection; }
+
+    // Draws from quizRandom(), so one sampler can be shared between threads.
+    bool sample(string& out) const
+    {
+        out.clear();
+        double total = count();
+        if (total <= 0) return false;
+
+        double r = uniform_real_distribution<double>(0, total)(quizRandom());
+        if (emptyAllowed())
+        {
+            if (r < 1) return true;
+            r -= 1;
+        }
+        int lastN = -1, lastQ = -1;
+        for (int n = max(1, minLen); n <= maxLen; n++)
+        {
+            for (int q = 0; q < Q; q++)
             {
-                //cout << "helo 1 ";
-                E_counter[0]++;
-                goto sos;
+                if (!accepting[q]) continue;
+                double w = ntCount[ntIdx(startNT, n, 0, q)];
+                if (w <= 0) continue;
+                lastN = n; lastQ = q;
+                if (r < w)
+                {
+                    expandNT(startNT, n, 0, q, out);
+                    return true;
+                }
+                r -= w;
             }
-        
-            //check if test is present in checked.
-            auto it = find(checked[sym].rhs.begin(), checked[sym].rhs.end(), test);
-            if (it != checked[sym].rhs.end()) 
+        }
+        expandNT(startNT, lastN, 0, lastQ, out); // rounding fell off the end
+        return true;
+    }
+
+private:
+    // Symbols of the normalized grammar: >= 0 is a non-terminal index, < 0 is ~terminal index.
+    vector<vector<vector<int>>> alts; // alts[A][a] = symbol sequence
+    vector<vector<int>> posBase;      // position id of alts[A][a][0]
+    vector<char> alphabet;
+    int startNT = -1;
+    bool startNullable = false;
+    int positions = 0;
+
+    int Q = 0;
+    vector<vector<int>> delta; // delta[state][terminal] = next state or -1
+    vector<bool> accepting;
+
+    int minLen = 0, maxLen = 0;
+    vector<double> ntCount; // [A][n][p][q]
+    vector<double> tail;    // [position][n][p][q]: ways alts[A][a][i..] derives length n from p to q
+    bool ready = false;
+    string rejection;
+
+    static const int MAX_STATES = 512;
+    static const int MAX_NULLABLE_POSITIONS = 16; // 2^k expansions of one alternative
+    static const size_t MAX_TABLE = 1u << 23;
+
+    size_t ntIdx(int A, int n, int p, int q) const { return (((size_t)A * (maxLen + 1) + n) * Q + p) * Q + q; }
+    size_t tailIdx(int pos, int n, int p, int q) const { return (((size_t)pos * (maxLen + 1) + n) * Q + p) * Q + q; }
+
+    bool emptyAllowed() const { return startNullable && minLen == 0 && accepting[0]; }
+
+    bool normalize(const map<string, Production>& rules, const string& start)
+    {
+        map<string, int> ntId;
+        int N = 0;
+        for (const auto& [name, prod] : rules) ntId[name] = N++;
+
+        map<char, int> termId;
+        vector<vector<vector<int>>> raw(N);
+        for (const auto& [name, prod] : rules)
+        {
+            for (const string& alt : prod.rhs)
             {
-                // test(Production rule is in checked)
-                //cout << "helo 2 ";
-                E_counter[1]++;
-                goto sos;
+                vector<int> seq;
+                for (char ch : alt)
+                {
+                    auto it = ntId.find(string(1, ch));
+                    if (it != ntId.end())
+                    {
+                        seq.push_back(it->second);
+                    }
+                    else
+                    {
+                        if (!termId.count(ch))
+                        {
+                            termId[ch] = alphabet.size();
+                            alphabet.push_back(ch);
+                        }
+                        seq.push_back(~termId[ch]);
+                    }
+                }
+                raw[ntId[name]].push_back(seq);
             }
+        }
 
-            vector<string> NewSymobls;
-            for(int i=0;i<test.length();i++)
+        vector<bool> nullable(N, false);
+        for (bool changed = true; changed; )
+        {
+            changed = false;
+            for (int A = 0; A < N; A++)
             {
-                NewSymobls.push_back(string(1,test[i]));
+                if (nullable[A]) continue;
+                for (auto& seq : raw[A])
+                {
+                    bool all = true;
+                    for (int s : seq) all = all && s >= 0 && nullable[s];
+                    if (all) { nullable[A] = changed = true; break; }
+                }
             }
-            string str = derive(NewSymobls, checked, depth);
-            if(str == "E")
+        }
+
+        // Drop every combination of nullable symbols, keeping only non-empty results.
+        vector<set<vector<int>>> noEmpty(N);
+        for (int A = 0; A < N; A++)
+        {
+            for (auto& seq : raw[A])
             {
-                E_counter[2]++;
-                checked[sym].lhs = sym;
-                checked[sym].rhs.push_back(test);
-                goto sos;
+                vector<int> opt;
+                for (int i = 0; i < (int)seq.size(); i++)
+                {
+                    if (seq[i] >= 0 && nullable[seq[i]]) opt.push_back(i);
+                }
+                if (opt.size() > MAX_NULLABLE_POSITIONS)
+                {
+                    rejection = "an alternative of " + next(rules.begin(), A)->first + " has more than "
+                        + to_string(MAX_NULLABLE_POSITIONS) + " nullable symbols";
+                    return false;
+                }
+                for (int mask = 0; mask < (1 << opt.size()); mask++)
+                {
+                    vector<int> out;
+                    int o = 0;
+                    for (int i = 0; i < (int)seq.size(); i++)
+                    {
+                        if (o < (int)opt.size() && opt[o] == i)
+                        {
+                            if (!(mask >> o++ & 1)) continue;
+                        }
+                        out.push_back(seq[i]);
+                    }
+                    if (!out.empty()) noEmpty[A].insert(out);
+                }
             }
-            else
+        }
+
+        // Replace unit chains A -> B -> ... by the non-unit alternatives they reach.
+        alts.assign(N, {});
+        for (int A = 0; A < N; A++)
+        {
+            vector<bool> reach(N, false);
+            vector<int> stack = {A};
+            reach[A] = true;
+            while (!stack.empty())
             {
-                //cout << "it is: " << str << endl; 
-                replaceStringWithVector(symbols, sym, str);
-                continue;
+                int B = stack.back(); stack.pop_back();
+                for (auto& seq : noEmpty[B])
+                {
+                    if (seq.size() == 1 && seq[0] >= 0 && !reach[seq[0]])
+                    {
+                        reach[seq[0]] = true;
+                        stack.push_back(seq[0]);
+                    }
+                }
+            }
+            set<vector<int>> merged;
+            for (int B = 0; B < N; B++)
+            {
+                if (!reach[B]) continue;
+                for (auto& seq : noEmpty[B])
+                {
+                    if (!(seq.size() == 1 && seq[0] >= 0)) merged.insert(seq);
+                }
+            }
+            alts[A].assign(merged.begin(), merged.end());
+        }
+
+        posBase.assign(N, {});
+        for (int A = 0; A < N; A++)
+        {
+            for (auto& seq : alts[A])
+            {
+                posBase[A].push_back(positions);
+                positions += seq.size();
+            }
+        }
+
+        auto it = ntId.find(start);
+        if (it != ntId.end())
+        {
+            startNT = it->second;
+            startNullable = nullable[startNT];
+        }
+        return true;
+    }
+
+    static vector<int> failure(const string& pat)
+    {
+        vector<int> fail(pat.size(), 0);
+        for (int i = 1, k = 0; i < (int)pat.size(); i++)
+        {
+            while (k > 0 && pat[i] != pat[k]) k = fail[k-1];
+            if (pat[i] == pat[k]) k++;
+            fail[i] = k;
+        }
+        return fail;
+    }
+
+    static int kmpStep(const string& pat, const vector<int>& fail, int j, char ch)
+    {
+        while (j > 0 && (j == (int)pat.size() || pat[j] != ch)) j = fail[j-1];
+        if (j < (int)pat.size() && pat[j] == ch) j++;
+        return j;
+    }
+
+    // DFA state is the tuple (prefix progress, suffix match, match of each required substring).
+    bool buildAutomaton(const GenConstraints& c)
+    {
+        if (startNT < 0) return false;
+        vector<string> req;
+        for (const string& s : c.required)
+        {
+            if (!s.empty()) req.push_back(s);
+        }
+        vector<int> sufFail = failure(c.suffix);
+        vector<vector<int>> reqFail;
+        for (const string& s : req) reqFail.push_back(failure(s));
+
+        int P = c.prefix.size();
+        map<vector<int>, int> id;
+        vector<vector<int>> tuples;
+        vector<int> init(2 + req.size(), 0);
+        id[init] = 0;
+        tuples.push_back(init);
+
+        for (int s = 0; s < (int)tuples.size(); s++)
+        {
+            if ((int)tuples.size() > MAX_STATES)
+            {
+                rejection = "the constraints need more than " + to_string(MAX_STATES) + " automaton states";
+                return false;
+            }
+            delta.push_back(vector<int>(alphabet.size(), -1));
+            for (int t = 0; t < (int)alphabet.size(); t++)
+            {
+                char ch = alphabet[t];
+                vector<int> cur = tuples[s];
+                if (c.forbidden.find(ch) != string::npos) continue;
+                if (cur[0] < P)
+                {
+                    if (c.prefix[cur[0]] != ch) continue;
+                    cur[0]++;
+                }
+                cur[1] = kmpStep(c.suffix, sufFail, cur[1], ch);
+                for (int r = 0; r < (int)req.size(); r++)
+                {
+                    if (cur[2+r] < (int)req[r].size()) cur[2+r] = kmpStep(req[r], reqFail[r], cur[2+r], ch);
+                }
+                auto ins = id.insert({cur, (int)tuples.size()});
+                if (ins.second) tuples.push_back(cur);
+                delta[s][t] = ins.first->second;
+            }
+        }
+
+        Q = tuples.size();
+        accepting.assign(Q, false);
+        for (int s = 0; s < Q; s++)
+        {
+            bool ok = tuples[s][0] == P && tuples[s][1] == (int)c.suffix.size();
+            for (int r = 0; r < (int)req.size(); r++) ok = ok && tuples[s][2+r] == (int)req[r].size();
+            accepting[s] = ok;
+        }
+        return true;
+    }
+
+    // Ways symbol sym derives a string of length n moving the DFA from p to q.
+    double symCount(int sym, int n, int p, int q) const
+    {
+        if (sym < 0) return n == 1 && delta[p][~sym] == q ? 1 : 0;
+        return ntCount[ntIdx(sym, n, p, q)];
+    }
+
+    double computeTail(const vector<int>& seq, int pos, int i, int n, int p, int q) const
+    {
+        int k = seq.size();
+        if (i == k - 1) return symCount(seq[i], n, p, q);
+        double sum = 0;
+        for (int m = 1; m <= n - (k - 1 - i); m++)
+        {
+            for (int r = 0; r < Q; r++)
+            {
+                double a = symCount(seq[i], m, p, r);
+                if (a > 0) sum += a * tail[tailIdx(pos + i + 1, n - m, r, q)];
+            }
+        }
+        return sum;
+    }
+
+    bool buildCounts()
+    {
+        int N = alts.size();
+        size_t cells = (size_t)(maxLen + 1) * Q * Q;
+        if (cells * (N + positions) > MAX_TABLE)
+        {
+            rejection = "the counting table would exceed " + to_string(MAX_TABLE) + " cells";
+            return false;
+        }
+        ntCount.assign(cells * N, 0);
+        tail.assign(cells * positions, 0);
+
+        // Round n only reads non-terminal counts of shorter strings, except the last symbol of an
+        // alternative, which is filled in after every non-terminal of length n is known.
+        for (int n = 1; n <= maxLen; n++)
+        {
+            for (int A = 0; A < N; A++)
+            {
+                for (int a = 0; a < (int)alts[A].size(); a++)
+                {
+                    const vector<int>& seq = alts[A][a];
+                    int pos = posBase[A][a];
+                    if (seq.size() < 2 && n != 1) continue;
+                    for (int p = 0; p < Q; p++)
+                    {
+                        for (int q = 0; q < Q; q++)
+                        {
+                            double v = computeTail(seq, pos, 0, n, p, q);
+                            tail[tailIdx(pos, n, p, q)] = v;
+                            ntCount[ntIdx(A, n, p, q)] += v;
+                        }
+                    }
+                }
+            }
+            for (int A = 0; A < N; A++)
+            {
+                for (int a = 0; a < (int)alts[A].size(); a++)
+                {
+                    const vector<int>& seq = alts[A][a];
+                    int pos = posBase[A][a];
+                    for (int i = (int)seq.size() - 1; i >= 1; i--)
+                    {
+                        for (int p = 0; p < Q; p++)
+                        {
+                            for (int q = 0; q < Q; q++)
+                            {
+                                tail[tailIdx(pos + i, n, p, q)] = computeTail(seq, pos, i, n, p, q);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    void expandSym(int sym, int n, int p, int q, string& out) const
+    {
+        if (sym < 0) out += alphabet[~sym];
+        else expandNT(sym, n, p, q, out);
+    }
+
+    void expandNT(int A, int n, int p, int q, string& out) const
+    {
+        double total = ntCount[ntIdx(A, n, p, q)];
+        double r = uniform_real_distribution<double>(0, total)(quizRandom());
+        int pick = -1;
+        for (int a = 0; a < (int)alts[A].size(); a++)
+        {
+            double w = tail[tailIdx(posBase[A][a], n, p, q)];
+            if (w <= 0) continue;
+            pick = a;
+            if (r < w) break;
+            r -= w;
+        }
+        expandSeq(alts[A][pick], posBase[A][pick], 0, n, p, q, out);
+    }
+
+    void expandSeq(const vector<int>& seq, int pos, int i, int n, int p, int q, string& out) const
+    {
+        int k = seq.size();
+        if (i == k - 1)
+        {
+            expandSym(seq[i], n, p, q, out);
+            return;
+        }
+        double total = tail[tailIdx(pos + i, n, p, q)];
+        double r = uniform_real_distribution<double>(0, total)(quizRandom());
+        int pickM = -1, pickR = -1;
+        bool found = false;
+        for (int m = 1; m <= n - (k - 1 - i) && !found; m++)
+        {
+            for (int s = 0; s < Q && !found; s++)
+            {
+                double w = symCount(seq[i], m, p, s) * tail[tailIdx(pos + i + 1, n - m, s, q)];
+                if (w <= 0) continue;
+                pickM = m; pickR = s;
+                found = r < w;
+                r -= w;
+            }
+        }
+        expandSym(seq[i], pickM, p, pickR, out);
+        expandSeq(seq, pos, i + 1, n - pickM, pickR, q, out);
+    }
+};
+
+const size_t SAMPLER_CACHE_ENTRIES = 256;
+
+// Built samplers by (grammar content hash, constraints). Building one is the whole counting DP;
+// sampling from it is a single walk, so repeated generateConstrained calls share the table.
+class SamplerCache
+{
+public:
+    shared_ptr<const ConstrainedSampler> get(uint64_t grammar, const map<string, Production>& rules,
+                                             const string& start, const GenConstraints& c)
+    {
+        string key = to_string(c.minLength) + '\n' + to_string(c.maxLength) + '\n' + c.prefix + '\n'
+            + c.suffix + '\n' + c.forbidden;
+        for (const string& r : c.required) key += '\n' + r;
+        {
+            lock_guard<mutex> lock(m);
+            auto found = built.find({grammar, key});
+            if (found != built.end()) return found->second;
+        }
+        auto sampler = make_shared<const ConstrainedSampler>(rules, start, c);
+        lock_guard<mutex> lock(m);
+        if (built.size() >= SAMPLER_CACHE_ENTRIES) built.clear();
+        built[{grammar, key}] = sampler;
+        return sampler;
+    }
+
+private:
+    mutex m;
+    map<pair<uint64_t, string>, shared_ptr<const ConstrainedSampler>> built;
+};
+
+SamplerCache samplerCache;
+
+// Static facts about a grammar, computed from its rules. The augmented start rule is left out.
+struct GrammarInfo
+{
+    set<string> nonTerminals;
+    set<char> terminals;
+    set<string> nullable;
+    set<string> productive; // derive at least one terminal string
+    set<string> reachable;  // appear in some sentential form of the start symbol
+    map<string, set<char>> first;
+    map<string, set<char>> follow; // '\0' marks the end of input
+    bool ll1 = true;
+    bool regular = false;   // right- or left-linear: a syntactic sufficient condition
+    int minLength = -1;     // shortest string of the language, -1 if the language is empty
+};
+
+GrammarInfo analyzeRules(const map<string, Production>& rules, const string& start, const string& augmented)
+{
+    GrammarInfo info;
+    for (const auto& [name, prod] : rules)
+    {
+        if (name != augmented) info.nonTerminals.insert(name);
+    }
+    auto isNT = [&](char c) { return info.nonTerminals.count(string(1, c)) > 0; };
+    for (const string& A : info.nonTerminals)
+    {
+        for (const string& alt : rules.at(A).rhs)
+        {
+            for (char c : alt)
+            {
+                if (!isNT(c)) info.terminals.insert(c);
+            }
+        }
+    }
+
+    map<string, int> minLen;
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (const string& A : info.nonTerminals)
+        {
+            for (const string& alt : rules.at(A).rhs)
+            {
+                bool nullableAlt = true;
+                for (char c : alt)
+                {
+                    string sym(1, c);
+                    if (!isNT(c))
+                    {
+                        nullableAlt = false;
+                        if (!info.first[A].count(c)) info.first[A].insert(c), changed = true;
+                        break;
+                    }
+                    for (char t : info.first[sym])
+                    {
+                        if (!info.first[A].count(t)) info.first[A].insert(t), changed = true;
+                    }
+                    if (!info.nullable.count(sym))
+                    {
+                        nullableAlt = false;
+                        break;
+                    }
+                }
+                if (nullableAlt && info.nullable.insert(A).second) changed = true;
+
+                int len = 0;
+                bool known = true;
+                for (char c : alt)
+                {
+                    if (!isNT(c)) len++;
+                    else if (minLen.count(string(1, c))) len += minLen[string(1, c)];
+                    else known = false;
+                }
+                if (known && (!minLen.count(A) || len < minLen[A]))
+                {
+                    minLen[A] = len;
+                    changed = true;
+                }
             }
         }
+    }
+    for (auto& [A, len] : minLen) info.productive.insert(A);
+
+    if (info.nonTerminals.count(start))
+    {
+        vector<string> stack = {start};
+        info.reachable.insert(start);
+        while (!stack.empty())
+        {
+            string A = stack.back();
+            stack.pop_back();
+            for (const string& alt : rules.at(A).rhs)
+            {
+                for (char c : alt)
+                {
+                    if (isNT(c) && info.reachable.insert(string(1, c)).second) stack.push_back(string(1, c));
+                }
+            }
+        }
+        info.follow[start].insert('\0');
+        if (minLen.count(start)) info.minLength = minLen[start];
+    }
+
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (const string& A : info.nonTerminals)
+        {
+            for (const string& alt : rules.at(A).rhs)
+            {
+                for (size_t k = 0; k < alt.size(); k++)
+                {
+                    if (!isNT(alt[k])) continue;
+                    string B(1, alt[k]);
+                    bool restNullable = true;
+                    for (size_t r = k + 1; r < alt.size() && restNullable; r++)
+                    {
+                        string sym(1, alt[r]);
+                        const set<char>& add = isNT(alt[r]) ? info.first[sym] : set<char>{alt[r]};
+                        for (char t : add)
+                        {
+                            if (info.follow[B].insert(t).second) changed = true;
+                        }
+                        restNullable = isNT(alt[r]) && info.nullable.count(sym);
+                    }
+                    if (restNullable)
+                    {
+                        for (char t : set<char>(info.follow[A]))
+                        {
+                            if (info.follow[B].insert(t).second) changed = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    bool rightLinear = true, leftLinear = true;
+    for (const string& A : info.nonTerminals)
+    {
+        set<char> predicted;
+        for (const string& alt : rules.at(A).rhs)
+        {
+            set<char> predicts;
+            bool nullableAlt = true;
+            int nts = 0;
+            for (size_t k = 0; k < alt.size(); k++)
+            {
+                if (isNT(alt[k]))
+                {
+                    nts++;
+                    if (k + 1 != alt.size()) rightLinear = false;
+                    if (k != 0) leftLinear = false;
+                }
+                if (!nullableAlt) continue;
+                if (!isNT(alt[k]))
+                {
+                    predicts.insert(alt[k]);
+                    nullableAlt = false;
+                }
+                else
+                {
+                    const set<char>& f = info.first[string(1, alt[k])];
+                    predicts.insert(f.begin(), f.end());
+                    nullableAlt = info.nullable.count(string(1, alt[k])) > 0;
+                }
+            }
+            if (nts > 1) rightLinear = leftLinear = false;
+            if (nullableAlt) predicts.insert(info.follow[A].begin(), info.follow[A].end());
+            for (char t : predicts)
+            {
+                if (!predicted.insert(t).second) info.ll1 = false;
+            }
+        }
+    }
+    info.regular = rightLinear || leftLinear;
+    return info;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Simplification. A CFG keeps its rules as written (shown to students, saved, hashed, counted by
+// the sampler) and works from simplified copies: useless non-terminals removed, duplicate
+// alternatives dropped and unit productions inlined for generation and derivation search, plus
+// a left-factored copy of that for the Earley recognizer. Every pass always runs; the language is
+// unchanged and the recognizer's fresh non-terminals never reach a student.
+// ---------------------------------------------------------------------------------------------
+
+typedef map<string, map<string, vector<string>>> UnitChains; // A -> alternative -> B, C (A => B => C => alternative)
+
+// Drops non-terminals that derive no string or cannot be reached, and every alternative using
+// one. An empty language is left as it is for the loader to report.
+void removeUseless(map<string, Production>& rules, const string& start, const string& augmented)
+{
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        GrammarInfo info = analyzeRules(rules, start, augmented);
+        if (!info.productive.count(start)) return;
+        for (auto it = rules.begin(); it != rules.end(); )
+        {
+            if (it->first != augmented && (!info.productive.count(it->first) || !info.reachable.count(it->first)))
+            {
+                it = rules.erase(it);
+                changed = true;
+                continue;
+            }
+            vector<string>& alts = it->second.rhs;
+            size_t before = alts.size();
+            alts.erase(remove_if(alts.begin(), alts.end(), [&](const string& alt)
+            {
+                for (char c : alt)
+                {
+                    string sym(1, c);
+                    if (info.nonTerminals.count(sym) && !info.productive.count(sym)) return true;
+                }
+                return false;
+            }), alts.end());
+            changed = changed || alts.size() != before;
+            ++it;
+        }
+    }
+}
+
+// Replaces every unit alternative A -> B by B's own alternatives, following unit chains, and
+// drops duplicates on the way. For each alternative A gained this way, chains records the
+// shortest run of non-terminals it went through.
+void inlineUnits(map<string, Production>& rules, const string& augmented, UnitChains& chains)
+{
+    map<string, Production> out = rules;
+    for (const auto& [A, prod] : rules)
+    {
+        if (A == augmented) continue;
+        map<string, vector<string>> via = {{A, {}}};
+        queue<string> todo;
+        todo.push(A);
+        vector<string> alts;
+        while (!todo.empty())
+        {
+            string B = todo.front();
+            todo.pop();
+            for (const string& alt : rules.at(B).rhs)
+            {
+                if (alt != augmented && rules.count(alt))
+                {
+                    if (!via.count(alt))
+                    {
+                        via[alt] = via[B];
+                        via[alt].push_back(alt);
+                        todo.push(alt);
+                    }
+                    continue;
+                }
+                if (find(alts.begin(), alts.end(), alt) != alts.end()) continue;
+                alts.push_back(alt);
+                if (!via[B].empty()) chains[A][alt] = via[B];
+            }
+        }
+        out[A].rhs = alts;
+    }
+    rules = out;
+}
+
+// Pulls the longest common prefix of alternatives sharing a first symbol into a fresh
+// non-terminal (A -> ab | ac becomes A -> aN, N -> b | c). Fresh names are unused capitals;
+// factoring stops when they run out.
+void leftFactor(map<string, Production>& rules, const string& augmented)
+{
+    set<char> used;
+    for (const auto& [A, prod] : rules)
+    {
+        used.insert(A.begin(), A.end());
+        for (const string& alt : prod.rhs) used.insert(alt.begin(), alt.end());
+    }
+    string fresh;
+    for (char c = 'A'; c <= 'Z'; c++)
+    {
+        if (!used.count(c)) fresh += c;
+    }
+
+    vector<string> todo;
+    for (const auto& [A, prod] : rules)
+    {
+        if (A != augmented) todo.push_back(A);
+    }
+    while (!todo.empty())
+    {
+        string A = todo.back();
+        todo.pop_back();
+        vector<string>& alts = rules[A].rhs;
+        for (size_t i = 0; i < alts.size(); i++)
+        {
+            vector<size_t> group;
+            for (size_t j = i; j < alts.size(); j++)
+            {
+                if (!alts[i].empty() && !alts[j].empty() && alts[j][0] == alts[i][0]) group.push_back(j);
+            }
+            if (group.size() < 2) continue;
+            if (fresh.empty()) return;
+
+            size_t len = alts[i].size();
+            for (size_t j : group)
+            {
+                size_t k = 0;
+                while (k < len && k < alts[j].size() && alts[j][k] == alts[i][k]) k++;
+                len = k;
+            }
+            string N(1, fresh.back());
+            fresh.pop_back();
+            vector<string> rests, kept;
+            for (size_t j : group) rests.push_back(alts[j].substr(len));
+            for (size_t j = 0; j < alts.size(); j++)
+            {
+                if (j == i) kept.push_back(alts[i].substr(0, len) + N);
+                else if (find(group.begin(), group.end(), j) == group.end()) kept.push_back(alts[j]);
+            }
+            alts = kept;
+            rules[N] = {N, rests};
+            todo.push_back(N);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Membership prefilter. Cheap necessary conditions for a string to be in a grammar's language,
+// derived once from the recognizer's rules: its alphabet, the shortest and (for finite languages)
+// longest lengths, which lengths mod LENGTH_MODULUS occur, the possible first and last
+// characters, and count invariants such as #a == #b for S -> aSb | empty. isValidString answers
+// a string that fails any of them without parsing. The alphabet scan and the counts behind the
+// invariants compare 16 bytes at a time with SSE2 where available (build with -DCFG_NO_SIMD
+// for the scalar loop).
+// ---------------------------------------------------------------------------------------------
+
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(CFG_NO_SIMD)
+#include <emmintrin.h>
+#define CFG_PREFILTER_SSE2
+#endif
+
+const int LENGTH_MODULUS = 6;        // catches parity and multiples of 3
+const int MAX_FILTER_TERMINALS = 16; // beyond this only the alphabet and lengths are checked
+
+struct MembershipFilter
+{
+    struct Invariant { int a, b, wa, wb, value; }; // wa * #terminals[a] - wb * #terminals[b] == value
+
+    bool enabled = false;      // admits everything until derived from a grammar
+    bool emptyLanguage = true;
+    string terminals;
+    uint64_t alphabet[4] = {}, first[4] = {}, last[4] = {}; // 256-bit sets of bytes
+    int minLength = 0, maxLength = -1;                        // -1: unbounded
+    uint32_t lengthResidues = 0;                              // bit r: some length is r mod LENGTH_MODULUS
+    vector<Invariant> invariants;
+
+    static bool has(const uint64_t* set, unsigned char c) { return set[c >> 6] >> (c & 63) & 1; }
+    static void add(uint64_t* set, unsigned char c) { set[c >> 6] |= uint64_t(1) << (c & 63); }
+
+    bool admits(const string& s) const
+    {
+        if (!enabled) return true;
+        int n = s.size();
+        if (emptyLanguage || n < minLength || (maxLength >= 0 && n > maxLength) || !(lengthResidues >> (n % LENGTH_MODULUS) & 1)) return false;
+        if (n == 0) return true;
+        if (!has(first, s[0]) || !has(last, s[n-1])) return false;
+        int counts[MAX_FILTER_TERMINALS] = {};
+        if (!countTerminals(s, counts)) return false;
+        for (const Invariant& inv : invariants)
+        {
+            if (inv.wa * counts[inv.a] - inv.wb * counts[inv.b] != inv.value) return false;
+        }
+        return true;
+    }
+
+private:
+    // Counts each terminal in s; false if s has a byte outside the alphabet.
+    bool countTerminals(const string& s, int* counts) const
+    {
+#ifdef CFG_PREFILTER_SSE2
+        if (terminals.size() <= (size_t)MAX_FILTER_TERMINALS)
+        {
+            for (size_t i = 0; i < s.size(); i += 16)
+            {
+                size_t len = min<size_t>(16, s.size() - i);
+                alignas(16) char block[16] = {};
+                memcpy(block, s.data() + i, len);
+                __m128i bytes = _mm_load_si128((const __m128i*)block);
+                int valid = len == 16 ? 0xFFFF : (1 << len) - 1, seen = 0;
+                for (size_t k = 0; k < terminals.size(); k++)
+                {
+                    int hits = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(terminals[k]))) & valid;
+                    seen |= hits;
+                    counts[k] += bitset<16>(hits).count();
+                }
+                if (seen != valid) return false;
+            }
+            return true;
+        }
+#endif
+        for (unsigned char c : s)
+        {
+            if (!has(alphabet, c)) return false;
+            size_t k = terminals.find(c);
+            if (k < (size_t)MAX_FILTER_TERMINALS) counts[k]++;
+        }
+        return true;
+    }
+};
+
+// Rotates the residue set r by n (mod LENGTH_MODULUS), or adds two residue sets.
+uint32_t shiftResidues(uint32_t r, int n)
+{
+    uint32_t out = 0;
+    for (int i = 0; i < LENGTH_MODULUS; i++)
+    {
+        if (r >> i & 1) out |= 1u << ((i + n) % LENGTH_MODULUS);
+    }
+    return out;
+}
+
+uint32_t addResidues(uint32_t x, uint32_t y)
+{
+    uint32_t out = 0;
+    for (int i = 0; i < LENGTH_MODULUS; i++)
+    {
+        if (x >> i & 1) out |= shiftResidues(y, i);
+    }
+    return out;
+}
+
+// info is analyzeRules of the same rules. The fixed points below run over a compact copy of the
+// rules: each symbol is a non-terminal index, or ~i for terminals[i].
+MembershipFilter buildMembershipFilter(const map<string, Production>& rules, const string& start, const GrammarInfo& info)
+{
+    MembershipFilter f;
+    vector<string> names(info.nonTerminals.begin(), info.nonTerminals.end());
+    for (const string& A : names)
+    {
+        if (A.size() != 1) return f; // alternatives name non-terminals by single characters
+    }
+    f.enabled = true;
+    if (info.minLength < 0) return f;
+    f.emptyLanguage = false;
+    f.minLength = info.minLength;
+    for (char t : info.terminals)
+    {
+        f.terminals += t;
+        MembershipFilter::add(f.alphabet, t);
+    }
+    auto first = info.first.find(start);
+    if (first != info.first.end())
+    {
+        for (char t : first->second) MembershipFilter::add(f.first, t);
+    }
+
+    int symbol[256];
+    fill(symbol, symbol + 256, INT_MIN);
+    for (int i = 0; i < (int)names.size(); i++) symbol[(unsigned char)names[i][0]] = i;
+    for (int i = 0; i < (int)f.terminals.size(); i++) symbol[(unsigned char)f.terminals[i]] = ~i;
+    int N = names.size(), S = symbol[(unsigned char)start[0]];
+    vector<vector<vector<int>>> alts(N);
+    vector<bool> nullable(N);
+    for (int A = 0; A < N; A++)
+    {
+        nullable[A] = info.nullable.count(names[A]) > 0;
+        for (const string& alt : rules.at(names[A]).rhs)
+        {
+            alts[A].emplace_back();
+            for (char c : alt) alts[A].back().push_back(symbol[(unsigned char)c]);
+        }
+    }
+
+    // Last characters: FIRST computed from the right end of each alternative.
+    vector<bitset<256>> last(N);
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (int A = 0; A < N; A++)
+        {
+            for (const vector<int>& alt : alts[A])
+            {
+                bitset<256> before = last[A];
+                for (auto s = alt.rbegin(); s != alt.rend(); ++s)
+                {
+                    if (*s < 0)
+                    {
+                        last[A].set((unsigned char)f.terminals[~*s]);
+                        break;
+                    }
+                    last[A] |= last[*s];
+                    if (!nullable[*s]) break;
+                }
+                changed |= last[A] != before;
+            }
+        }
+    }
+    for (int c = 0; c < 256; c++)
+    {
+        if (last[S][c]) MembershipFilter::add(f.last, c);
+    }
+
+    // Length residues: a least fixed point, growing each non-terminal's set.
+    vector<uint32_t> residues(N);
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (int A = 0; A < N; A++)
+        {
+            for (const vector<int>& alt : alts[A])
+            {
+                uint32_t r = 1;
+                for (int s : alt) r = s >= 0 ? addResidues(r, residues[s]) : shiftResidues(r, 1);
+                if ((residues[A] | r) != residues[A]) residues[A] |= r, changed = true;
+            }
+        }
+    }
+    f.lengthResidues = residues[S];
+
+    // Longest string: settles within one round per non-terminal unless some recursion grows it.
+    vector<int> maxLen(N, -1);
+    bool growing = true;
+    for (int round = 0; round <= N + 1 && growing; round++)
+    {
+        growing = false;
+        for (int A = 0; A < N; A++)
+        {
+            for (const vector<int>& alt : alts[A])
+            {
+                int len = 0;
+                for (int s : alt)
+                {
+                    if (s < 0) len++;
+                    else if (maxLen[s] < 0 || len < 0) len = -1;
+                    else len += maxLen[s];
+                }
+                if (len > maxLen[A]) maxLen[A] = len, growing = true;
+            }
+        }
+    }
+    f.maxLength = growing ? -1 : maxLen[S];
+
+    // Count invariants over single terminals and pairs with small weights: each non-terminal's
+    // value is unknown, one constant, or varying (VARIES); the invariant holds when the start
+    // symbol's value ends up constant.
+    if (f.terminals.size() > (size_t)MAX_FILTER_TERMINALS) return f;
+    vector<MembershipFilter::Invariant> candidates;
+    int T = f.terminals.size();
+    for (int a = 0; a < T; a++)
+    {
+        candidates.push_back({a, a, 1, 0, 0});
+        for (int b = a + 1; b < T; b++)
+        {
+            candidates.push_back({a, b, 1, 1, 0});
+            candidates.push_back({a, b, 1, 2, 0});
+            candidates.push_back({a, b, 2, 1, 0});
+        }
+    }
+    const int UNKNOWN = INT_MIN, VARIES = INT_MAX;
+    int K = candidates.size();
+    vector<int> value(N * K, UNKNOWN), weight(T * K), v(K);
+    for (int k = 0; k < K; k++)
+    {
+        weight[candidates[k].a * K + k] += candidates[k].wa;
+        weight[candidates[k].b * K + k] -= candidates[k].wb;
+    }
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (int A = 0; A < N; A++)
+        {
+            int* current = &value[A * K];
+            for (const vector<int>& alt : alts[A])
+            {
+                fill(v.begin(), v.end(), 0);
+                for (int s : alt)
+                {
+                    const int* w = s >= 0 ? &value[s * K] : &weight[~s * K];
+                    for (int k = 0; k < K; k++)
+                    {
+                        if (v[k] == UNKNOWN || w[k] == UNKNOWN) v[k] = UNKNOWN;
+                        else if (v[k] == VARIES || w[k] == VARIES) v[k] = VARIES;
+                        else v[k] += w[k];
+                    }
+                }
+                for (int k = 0; k < K; k++)
+                {
+                    if (v[k] == UNKNOWN || current[k] == VARIES || current[k] == v[k]) continue;
+                    current[k] = current[k] == UNKNOWN ? v[k] : VARIES;
+                    changed = true;
+                }
+            }
+        }
+    }
+    for (int k = 0; k < K; k++)
+    {
+        int c = value[S * K + k];
+        if (c == UNKNOWN || c == VARIES) continue;
+        candidates[k].value = c;
+        f.invariants.push_back(candidates[k]);
+    }
+    return f;
+}
+
+class CFG {
+private:
+    map<string, Production> rules;
+    string startSymbol;
+    string augmentedStart;
+    uint64_t hash = 0; // of startSymbol and rules; result cache key
+
+    // Derived from rules by refresh(); see removeUseless, inlineUnits and leftFactor.
+    map<string, Production> simplified; // generation and derivation search
+    UnitChains unitChains;              // replays simplified derivations in rules
+    map<string, Production> recognizer; // Earley
+    set<string> recognizerNullable;
+    MembershipFilter filter;            // rejects most non-members before any parse
+
+    struct State 
+    {
+        string lhs;
+        vector<string> rhs;
+        int dot;
+        int start;
+        bool operator<(State const &other) const 
+        {
+            if (lhs != other.lhs) return lhs < other.lhs;
+            if (rhs != other.rhs) return rhs < other.rhs;
+            if (dot != other.dot) return dot < other.dot;
+            return start < other.start;
+        }
+    };
+
+public:
+    CFG(const string& start) : startSymbol(start)  // reminder to modify filling so that augmentedStart is accounted for
+    {
+        augmentedStart = startSymbol + "'";
+        rules[augmentedStart] = {augmentedStart, {startSymbol}};
+        refresh();
+    }
+
+    void addRule(const string& lhs, const vector<string>& alternatives) 
+    {
+        rules[lhs] = { lhs, alternatives };
+        refresh();
+    }
+
+    // Several rules at once, with a single refresh; every loader and Add_CFGs use this.
+    void addRules(const vector<Production>& productions)
+    {
+        for (const Production& p : productions) rules[p.lhs] = p;
+        refresh();
+    }
+
+    const map<string, Production>& getRules() const { return rules; }
+    const string& getStartSymbol() const { return startSymbol; }
+    bool isAugmentedStart(const string& sym) const { return sym == augmentedStart; }
+    uint64_t contentHash() const { return hash; }
+
+    string generateString(int maxDepth = 5) const
+    {
+        Budget unlimited;
+        return generateString(maxDepth, unlimited).value;
+    }
+
+    OpResult<string> generateString(int maxDepth, Budget& budget) const
+    {
+        METRIC_SPAN("generateString", H_GEN_US);
+        METRIC_INC(M_GEN_CALLS);
+        string result;
+        map<string,Production> checked;
+        vector<string> symbols;
+        int retries = 0;
+        try_again:
+        if (!budget.step()) return {budget.status, ""};
+        symbols = {startSymbol};
+        result = derive(symbols, checked, maxDepth, budget);
+        if(result == "E")
+        {
+            if (budget.exhausted()) return {budget.status, ""};
+            symbols.clear();
+            checked.clear();
+            retries++;
+            METRIC_INC(M_GEN_RETRIES);
+            goto try_again;
+        }
+
+        METRIC_OBSERVE(H_GEN_RETRIES, retries);
+        return {OpStatus::Ok, result};
+    }
+
+    // Like generateString, but the result satisfies c (length range, prefix/suffix, required and
+    // forbidden terminals). Returns false when no string of the grammar satisfies c, or when the
+    // sampler gives up (grammar or constraints too large to count); rejected, if given, receives
+    // the reason in that case and is left empty when c is simply unsatisfiable.
+    bool generateConstrained(const GenConstraints& c, string& out, string* rejected = nullptr) const
+    {
+        shared_ptr<const ConstrainedSampler> sampler = samplerCache.get(hash, rules, startSymbol, c);
+        if (rejected) *rejected = sampler->rejected();
+        return sampler->sample(out);
+    }
+
+    bool isValidString(const string& input) const
+    {
+        Budget unlimited;
+        return isValidString(input, unlimited).value;
+    }
+
+    OpResult<bool> isValidString(const string& input, Budget& budget) const
+    {
+        if (!filter.admits(input))
+        {
+            METRIC_INC(M_PREFILTER_REJECTS);
+            return {OpStatus::Ok, false};
+        }
+        CachedResult cached;
+        if (resultCache.lookup(hash, CACHE_VALIDITY, input, cached))
+        {
+            if (!budget.step(cached.steps)) return {budget.status, false};
+            return {OpStatus::Ok, cached.valid};
+        }
+        long long before = budget.steps;
+        OpResult<bool> result = recognize(input, budget);
+        if (result.ok()) resultCache.store(hash, CACHE_VALIDITY, input, {result.value, {}, budget.steps - before});
+        return result;
+    }
+
+    // The recognizer alone: no prefilter, no result cache. For timing the recognizer itself.
+    bool recognizeUncached(const string& input) const
+    {
+        Budget unlimited;
+        return recognize(input, unlimited).value;
+    }
+
+    vector<string> deriveLeftmost(const string& input) const
+    {
+        Budget unlimited;
+        return deriveLeftmost(input, unlimited).value;
+    }
+
+    OpResult<vector<string>> deriveLeftmost(const string& input, Budget& budget) const
+    {
+        if (!filter.admits(input))
+        {
+            METRIC_INC(M_PREFILTER_REJECTS);
+            return {OpStatus::Ok, {}};
+        }
+        CachedResult cached;
+        if (resultCache.lookup(hash, CACHE_LEFTMOST, input, cached))
+        {
+            if (!budget.step(cached.steps)) return {budget.status, {}};
+            return {OpStatus::Ok, cached.derivation};
+        }
+        long long before = budget.steps;
+        OpResult<vector<string>> result = searchLeftmost(input, budget);
+        if (result.ok()) resultCache.store(hash, CACHE_LEFTMOST, input, {true, result.value, budget.steps - before});
+        return result;
+    }
+
+    vector<string> deriveRightmost(const string& input) const
+    {
+        Budget unlimited;
+        return deriveRightmost(input, unlimited).value;
+    }
+
+    OpResult<vector<string>> deriveRightmost(const string& input, Budget& budget) const
+    {
+        if (!filter.admits(input))
+        {
+            METRIC_INC(M_PREFILTER_REJECTS);
+            return {OpStatus::Ok, {}};
+        }
+        CachedResult cached;
+        if (resultCache.lookup(hash, CACHE_RIGHTMOST, input, cached))
+        {
+            if (!budget.step(cached.steps)) return {budget.status, {}};
+            return {OpStatus::Ok, cached.derivation};
+        }
+        long long before = budget.steps;
+        OpResult<vector<string>> result = searchRightmost(input, budget);
+        if (result.ok()) resultCache.store(hash, CACHE_RIGHTMOST, input, {true, result.value, budget.steps - before});
+        return result;
+    }
+
+private:
+    // Recomputes everything derived from rules. Equal grammars hash equally wherever they were
+    // loaded from; the separators keep {"ab"} and {"a","b"} apart.
+    void refresh()
+    {
+        hash = fnv1a(startSymbol);
+        for (const auto& [key, prod] : rules)
+        {
+            hash = fnv1a("\x01" + key, hash);
+            for (const string& alt : prod.rhs) hash = fnv1a("\x02" + alt, hash);
+        }
+
+        simplified = rules;
+        unitChains.clear();
+        removeUseless(simplified, startSymbol, augmentedStart);
+        inlineUnits(simplified, augmentedStart, unitChains);
+        removeUseless(simplified, startSymbol, augmentedStart);
+        recognizer = simplified;
+        leftFactor(recognizer, augmentedStart);
+        GrammarInfo recognizerInfo = analyzeRules(recognizer, startSymbol, augmentedStart);
+        recognizerNullable = recognizerInfo.nullable;
+        filter = buildMembershipFilter(recognizer, startSymbol, recognizerInfo);
+    }
+
+    // A derivation found in simplified, as the original rules produce it: a step that used an
+    // inlined alternative is preceded by the unit steps it skipped.
+    vector<string> replayInOriginal(const vector<vector<string>>& path, bool leftmost) const
+    {
+        vector<string> steps;
+        for (size_t k = 0; k < path.size(); k++)
+        {
+            if (k > 0)
+            {
+                const vector<string>& from = path[k-1];
+                const vector<string>& to = path[k];
+                int i = -1;
+                for (int j = 0; j < (int)from.size() && !(leftmost && i >= 0); j++)
+                {
+                    if (simplified.count(from[j])) i = j;
+                }
+                string alt, before, after;
+                for (size_t j = i; j < i + to.size() + 1 - from.size(); j++) alt += to[j];
+                for (int j = 0; j < i; j++) before += from[j];
+                for (size_t j = i + 1; j < from.size(); j++) after += from[j];
+                auto chains = unitChains.find(from[i]);
+                if (chains != unitChains.end() && chains->second.count(alt))
+                {
+                    for (const string& B : chains->second.at(alt)) steps.push_back(before + B + after);
+                }
+            }
+            string form;
+            for (const string& sym : path[k]) form += sym;
+            steps.push_back(form);
+        }
+        return steps;
+    }
+
+    OpResult<bool> recognize(const string& input, Budget& budget) const
+    {
+        METRIC_SPAN("isValidString", H_EARLEY_US);
+        METRIC_INC(M_EARLEY_CALLS);
+        int n = input.size();
+        vector< set<State> > chart(n+1);
+        vector< queue<State> > work(n+1);
+
+        auto addState = [&](int idx, State const &st) 
+        {
+            if (!chart[idx].count(st)) 
+            {
+                chart[idx].insert(st);
+                work[idx].push(st);
+            }
+        };
+
+        vector<string> initRhs = tokenize(recognizer.at(augmentedStart).rhs[0]);
+        addState(0, State{augmentedStart, initRhs, 0, 0});
+
+        for (int i = 0; i <= n; ++i)
+        {
+            while (!work[i].empty()) 
+            {
+                if (!budget.step()) return {budget.status, false};
+                State s = work[i].front(); 
+                work[i].pop();
+                if (s.dot < (int)s.rhs.size()) 
+                {
+                    string nextSym = s.rhs[s.dot];
+                    if (recognizer.count(nextSym))
+                    {
+                        for (auto &alt : recognizer.at(nextSym).rhs) 
+                        {
+                            vector<string> tokens = tokenize(alt);
+                            addState(i, State{nextSym, tokens, 0, i});
+                        }
+                        // A nullable symbol may already have completed at i before s was added,
+                        // so step over it here rather than wait for a completion (Aycock-Horspool).
+                        if (recognizerNullable.count(nextSym))
+                        {
+                            State skip = s;
+                            skip.dot++;
+                            addState(i, skip);
+                        }
+                    }
+                    else if (i < n && nextSym.size() == 1 && input[i] == nextSym[0]) 
+                    {
+                        State scan = s;
+                        scan.dot++;
+                        addState(i+1, scan);
+                    }
+                } 
+                else 
+                {
+                    for (auto &st2 : chart[s.start]) 
+                    {
+                        if (st2.dot < (int)st2.rhs.size() && st2.rhs[st2.dot] == s.lhs) 
+                        {
+                            State comp = st2;
+                            comp.dot++;
+                            addState(i, comp);
+                        }
+                    }
+                }
+            }
+        }
+
+#ifdef CFG_METRICS
+        size_t chartStates = 0;
+        for (auto& col : chart) chartStates += col.size();
+        METRIC_OBSERVE(H_EARLEY_CHART_STATES, chartStates);
+#endif
+
+        vector<string> finalRhs = tokenize(recognizer.at(augmentedStart).rhs[0]);
+        State finalState{augmentedStart, finalRhs, 1, 0};
+        return {OpStatus::Ok, chart[n].count(finalState) > 0};
+    }
+
+    OpResult<vector<string>> searchLeftmost(const string& input, Budget& budget) const
+    {
+        METRIC_SPAN("deriveLeftmost", H_BFS_US);
+        return searchDerivation(input, budget, true);
+    }
+
+    OpResult<vector<string>> searchRightmost(const string& input, Budget& budget) const
+    {
+        METRIC_SPAN("deriveRightmost", H_BFS_US);
+        return searchDerivation(input, budget, false);
+    }
+
+    // Breadth-first search over sentential forms of simplified, expanding the leftmost (or
+    // rightmost) non-terminal. Terminals never go away, so a form is dropped when its terminals
+    // outnumber the input or the terminals before its first and after its last non-terminal are
+    // not the input's prefix and suffix. Every enqueued form costs a budget step, which bounds
+    // the memory as well as the time; a node keeps its parent's index instead of its own path.
+    OpResult<vector<string>> searchDerivation(const string& input, Budget& budget, bool leftmost) const
+    {
+        METRIC_INC(M_BFS_CALLS);
+        using Form = vector<string>;
+        struct Node { Form form; int parent; };
+        vector<Node> nodes;
+        set<string> seen;
+        size_t queuePeak = 1;
+
+        auto admissible = [&](const Form& form)
+        {
+            int n = input.size(), terminals = 0, first = -1, last = -1;
+            for (int i = 0; i < (int)form.size(); i++)
+            {
+                if (simplified.count(form[i]))
+                {
+                    if (first < 0) first = i;
+                    last = i;
+                }
+                else if (++terminals > n) return false;
+            }
+            if (first < 0) first = last = form.size();
+            for (int i = 0; i < first; i++)
+            {
+                if (form[i][0] != input[i]) return false;
+            }
+            for (int i = form.size() - 1, j = n - 1; i > last; i--, j--)
+            {
+                if (j < 0 || form[i][0] != input[j]) return false;
+            }
+            return first < (int)form.size() || terminals == n;
+        };
+        auto enqueue = [&](Form&& form, int parent)
+        {
+            string key;
+            for (auto &x : form) key += x + " ";
+            if (!seen.insert(key).second) return true;
+            if (!admissible(form)) return true;
+            if (!budget.step()) return false;
+            nodes.push_back({ move(form), parent });
+            return true;
+        };
+
+        if (!enqueue({ startSymbol }, -1)) return {budget.status, {}};
+        for (size_t head = 0; head < nodes.size(); head++)
+        {
+            queuePeak = max(queuePeak, nodes.size() - head);
+            METRIC_INC(M_BFS_NODES);
+            const Form& form = nodes[head].form;
+
+            int i = -1;
+            for (int j = 0; j < (int)form.size() && !(leftmost && i >= 0); j++)
+            {
+                if (simplified.count(form[j])) i = j;
+            }
+            if (i < 0)
+            {
+                // admissible() only lets a form without non-terminals in if it spells the input.
+                METRIC_OBSERVE(H_BFS_QUEUE_PEAK, queuePeak);
+                vector<Form> path;
+                for (int k = head; k >= 0; k = nodes[k].parent) path.push_back(nodes[k].form);
+                reverse(path.begin(), path.end());
+                return {OpStatus::Ok, replayInOriginal(path, leftmost)};
+            }
+
+            for (auto &alt : simplified.at(form[i]).rhs)
+            {
+                const Form& cur = nodes[head].form; // nodes may grow below
+                Form next(cur.begin(), cur.begin() + i);
+                for (char c : alt) next.push_back(string(1, c));
+                next.insert(next.end(), cur.begin() + i + 1, cur.end());
+                if (!enqueue(move(next), head)) return {budget.status, {}};
+            }
+        }
+        METRIC_OBSERVE(H_BFS_QUEUE_PEAK, queuePeak);
+        return {OpStatus::Ok, {}};
+    }
+
+    string derive(vector<string>& symbols, map<string,Production>& checked, int depth, Budget& budget) const
+    {
+        if (!budget.step()) return "E";
+        //srand(time(NULL));
+        int E_counter[3] = {0};
+        mt19937& rd = quizRandom();
+        if (depth < 0)
+        {   
+            for (string& sym : symbols)
+            {
+                if (isNonTerminal(sym)) return "E"; // failed derivation
+            }
+            string result;
+            for (string& sym : symbols) result += sym;
+            return result; // case: To be Cecked;
+        }
+
+        int flag = 1;
+        vector<string> toDerive;
+        string result;
+        for(string& sys: symbols)
+        {
+            if(isNonTerminal(sys)) 
+            { 
+                flag = 0;
+                depth--;
+                toDerive.push_back(sys);
+            }
+        }
+
+        if(flag == 1) // case where no non-terminals in symbols
+        {
+            for(string& sys: symbols)
+            {
+                result += sys;
+            }
+            return result;
+        }
+
+        // Try to build the result symbol by symbol
+        string test;
+        
+        for(string& sym : toDerive)
+        {
+            sos:
+            if(E_counter[0] >= 10 || E_counter[1] >= 10 || E_counter[2] >= 10 || budget.exhausted())
+            {
+                return "E";
+            }
+            test = simplified.at(sym).rhs[rd() % simplified.at(sym).rhs.size()];
+            if(test == "" && depth > 0)
+            {
+                //cout << "helo 1 ";
+                E_counter[0]++;
+                goto sos;
+            }
+        
+            //check if test is present in checked.
+            auto it = find(checked[sym].rhs.begin(), checked[sym].rhs.end(), test);
+            if (it != checked[sym].rhs.end()) 
+            {
+                // test(Production rule is in checked)
+                //cout << "helo 2 ";
+                E_counter[1]++;
+                goto sos;
+            }
+
+            vector<string> NewSymobls;
+            for(int i=0;i<test.length();i++)
+            {
+                NewSymobls.push_back(string(1,test[i]));
+            }
+            string str = derive(NewSymobls, checked, depth, budget);
+            if(str == "E")
+            {
+                E_counter[2]++;
+                checked[sym].lhs = sym;
+                checked[sym].rhs.push_back(test);
+                goto sos;
+            }
+            else
+            {
+                //cout << "it is: " << str << endl; 
+                replaceStringWithVector(symbols, sym, str);
+                continue;
+            }
+        }
+
+        for (string& sym : symbols) result += sym;
+        return result;
+    }
+
+    bool isNonTerminal(const string& sym) const
+    {
+        return simplified.find(sym) != simplified.end();
+    }
+
+    vector<string> tokenize(const string &alt) const
+    {
+        vector<string> toks;
+        for (char c: alt) toks.push_back(string(1, c));
+        return toks;
+    }
+
+    friend ostream& operator<<(ostream& os, const CFG& p);
+    friend bool writeGrammarArrayToFile(const string& filename, const vector<CFG>& grammars, const vector<string>& rejected);
+};
+
+ostream& operator<<(ostream& os, const CFG& p) 
+{
+    for(const auto& [symbol, prod_rule] : p.rules)
+    {
+        if(symbol == "S'")
+        {
+            continue;
+        }
+        os << "Non-Terminal : " << symbol << endl;
+        for(int i=0;i<prod_rule.rhs.size(); i++)
+        {
+            // string str = "";
+            // for(int j=0;j<prod_rule.rhs[i].size();j++)
+            // {
+            //     str += prod_rule.rhs[i][j];
+            // }
+            os << "Rule: " << prod_rule.rhs[i] << endl;
+        }
+    }
+    return os;
+}
+
+const int LEADERBOARDS = 4;
+set<int, greater<int>> leaderboard[LEADERBOARDS]; // 0=easy, 1=m, 2=h, 3=expr
+
+// Moves tmp over target. rename() replaces atomically on POSIX; Windows refuses to rename onto an
+// existing file, so there the old file is removed first.
+bool replaceFile(const string& tmp, const string& target)
+{
+    if (rename(tmp.c_str(), target.c_str()) == 0) return true;
+    remove(target.c_str());
+    return rename(tmp.c_str(), target.c_str()) == 0;
+}
+
+// Writes to filename.tmp and renames it over filename, so a reader never opens half a bank.
+// rejected holds blocks the loader could not parse; they go back after the grammars unchanged,
+// so an edit never deletes a grammar someone still has to fix by hand.
+bool writeGrammarArrayToFile(const string& filename, const vector<CFG>& grammars, const vector<string>& rejected) 
+{
+    string tmp = filename + ".tmp";
+    ofstream outFile(tmp);
+
+    for (const auto& grammar : grammars) {
+        outFile << "START " << grammar.startSymbol << "\n";
+        outFile << "RULES " << grammar.rules.size() << "\n";
+        for (const auto& [key, prod] : grammar.rules) 
+        {
+            outFile << key << " -> " << prod.lhs;
+            for (const auto& sym : prod.rhs) 
+            {
+                if(sym == "")
+                {
+                    outFile << " empty";
+                }
+                else
+                {
+                    outFile << " " << sym;
+                }   
+            }
+            outFile << "\n";
+        }
+        outFile << "END\n";
+    }
+    for (const string& block : rejected) outFile << block;
+
+    outFile.close();
+    return outFile && replaceFile(tmp, filename);
+}
+
+GrammarInfo analyzeGrammar(const CFG& g)
+{
+    return analyzeRules(g.getRules(), g.getStartSymbol(), g.getStartSymbol() + "'");
+}
+
+// ---------------------------------------------------------------------------------------------
+// Validating bank loader. A file is read once, cut at its START lines, and the grammars are
+// parsed and analyzed by up to one worker per core; the three difficulty files load side by side.
+// Grammars with a malformed block or an empty language are reported and left out of the bank
+// (their text stays in the file); unproductive or unreachable non-terminals are reported but kept.
+// ---------------------------------------------------------------------------------------------
+
+struct LoadIssue
+{
+    string file;
+    int line;       // 1-based
+    bool error;     // false: warning, the grammar was kept
+    string message;
+};
+
+void reportLoadIssues(const vector<LoadIssue>& issues, ostream& os)
+{
+    for (const LoadIssue& i : issues)
+    {
+        os << i.file << ":" << i.line << ": " << (i.error ? "error: " : "warning: ") << i.message << endl;
+    }
+}
+
+const int GRAMMARS_PER_WORKER = 32; // below this a worker thread costs more than it saves
+
+// Parses lines[begin, end), the block of one grammar starting at its START line.
+bool parseGrammarBlock(const vector<string>& lines, int begin, int end, const string& file, CFG& out, vector<LoadIssue>& issues)
+{
+    auto fail = [&](int at, const string& message)
+    {
+        issues.push_back({file, at + 1, true, message});
+        return false;
+    };
+
+    string start = lines[begin].substr(6);
+    if (start.empty() || start.find(' ') != string::npos) return fail(begin, "bad start symbol '" + start + "'");
+    int ruleCount;
+    istringstream header(begin + 1 < end ? lines[begin + 1] : "");
+    string word;
+    if (!(header >> word >> ruleCount) || word != "RULES" || ruleCount < 0) return fail(begin + 1, "expected 'RULES <count>'");
+
+    CFG g(start);
+    vector<Production> productions;
+    set<string> seen;
+    int at = begin + 2, found = 0;
+    for (; at < end && lines[at] != "END"; at++)
+    {
+        size_t arrowPos = lines[at].find(" -> ");
+        if (arrowPos == string::npos || arrowPos == 0) return fail(at, "expected '<non-terminal> -> <non-terminal> <alternatives>'");
+        string key = lines[at].substr(0, arrowPos);
+        istringstream ss(lines[at].substr(arrowPos + 4));
+        string lhs, sym;
+        ss >> lhs;
+        if (lhs != key) return fail(at, "rule for '" + key + "' is labelled '" + lhs + "'");
+        if (!seen.insert(key).second) return fail(at, "second rule for '" + key + "'");
+        found++;
+        if (g.isAugmentedStart(key)) continue; // written out by writeGrammarArrayToFile; rebuilt by CFG
+        vector<string> alternatives;
+        while (ss >> sym) alternatives.push_back(sym == "empty" ? "" : sym);
+        productions.push_back({key, alternatives});
+    }
+    if (at == end) return fail(end - 1, "grammar starting at line " + to_string(begin + 1) + " has no END");
+    g.addRules(productions);
+    if (found != ruleCount) return fail(begin + 1, "RULES says " + to_string(ruleCount) + " but " + to_string(found) + " rule lines follow");
+    for (int extra = at + 1; extra < end; extra++)
+    {
+        if (!lines[extra].empty()) issues.push_back({file, extra + 1, false, "ignored text after END"});
+    }
+
+    GrammarInfo info = analyzeGrammar(g);
+    if (!info.nonTerminals.count(start)) return fail(begin, "start symbol '" + start + "' has no rule");
+    if (info.minLength < 0) return fail(begin, "grammar generates no strings");
+    string unproductive, unreachable;
+    for (const string& A : info.nonTerminals)
+    {
+        if (!info.productive.count(A)) unproductive += " " + A;
+        if (!info.reachable.count(A)) unreachable += " " + A;
+    }
+    if (!unproductive.empty()) issues.push_back({file, begin + 1, false, "non-terminals that derive no string:" + unproductive});
+    if (!unreachable.empty()) issues.push_back({file, begin + 1, false, "non-terminals unreachable from the start:" + unreachable});
+
+    out = g;
+    METRIC_INC(M_GRAMMARS_LOADED);
+    return true;
+}
+
+// Loads and validates a whole bank file into out, in file order. The raw text of every block
+// that fails to parse goes to rejected, for writeGrammarArrayToFile to keep.
+bool loadBankFile(const string& filename, vector<CFG>& out, vector<LoadIssue>& issues, vector<string>& rejected)
+{
+    METRIC_SPAN("loadBankFile", H_LOAD_US);
+    METRIC_INC(M_FILE_LOADS);
+    out.clear();
+    rejected.clear();
+    ifstream inFile(filename, ios::binary);
+    if (!inFile)
+    {
+        issues.push_back({filename, 0, true, "cannot open file"});
+        return false;
+    }
+    vector<string> lines;
+    vector<int> starts;
+    string line;
+    while (getline(inFile, line))
+    {
+        if (!line.empty() && line.back() == '\r') line.pop_back(); // banks are saved with CRLF
+        if (line.compare(0, 6, "START ") == 0) starts.push_back(lines.size());
+        else if (starts.empty() && !line.empty()) issues.push_back({filename, (int)lines.size() + 1, false, "ignored text before the first START"});
+        lines.push_back(line);
+    }
+    starts.push_back(lines.size());
+
+    int grammars = starts.size() - 1;
+    int workers = max(1, min<int>(thread::hardware_concurrency(), grammars / GRAMMARS_PER_WORKER));
+    vector<vector<CFG>> parsed(workers);
+    vector<vector<LoadIssue>> found(workers);
+    vector<vector<string>> bad(workers);
+    auto work = [&](int w)
+    {
+        CFG g("S");
+        for (int k = grammars * w / workers; k < grammars * (w + 1) / workers; k++)
+        {
+            if (parseGrammarBlock(lines, starts[k], starts[k + 1], filename, g, found[w])) parsed[w].push_back(g);
+            else
+            {
+                string block;
+                for (int i = starts[k]; i < starts[k + 1]; i++) block += lines[i] + "\n";
+                bad[w].push_back(block);
+            }
+        }
+    };
+    vector<thread> threads;
+    for (int w = 1; w < workers; w++) threads.emplace_back(work, w);
+    work(0);
+    for (thread& t : threads) t.join();
+
+    for (int w = 0; w < workers; w++)
+    {
+        out.insert(out.end(), parsed[w].begin(), parsed[w].end());
+        issues.insert(issues.end(), found[w].begin(), found[w].end());
+        rejected.insert(rejected.end(), bad[w].begin(), bad[w].end());
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Grammar bank. Each bank file is held as an immutable snapshot behind a shared_ptr that is
+// swapped atomically (RCU style). A quiz takes a snapshot once and keeps reading it without
+// locks; an admin edit copies the current version, changes the copy, writes the file and then
+// publishes. Old snapshots are freed when their last quiz lets go of them.
+// ---------------------------------------------------------------------------------------------
+
+const char* const BANK_FILES[3] = { "easy_cfgs.txt", "medium_cfgs.txt", "hard_cfgs.txt" };
+
+struct BankSnapshot
+{
+    string file;
+    unsigned long long version = 0; // 0 for private working sets that are never published
+    vector<CFG> grammars;
+    vector<string> rejected; // blocks that failed to load, written back as they were
+};
+typedef shared_ptr<const BankSnapshot> BankRef;
+
+enum BankUpdate { BANK_UPDATED, BANK_CONFLICT, BANK_WRITE_FAILED };
+
+class GrammarBank
+{
+public:
+    // Readers: one atomic load. The first reader of a difficulty loads its file.
+    BankRef current(int difficulty)
+    {
+        BankRef snap = atomic_load(&slots[difficulty]);
+        if (snap) return snap;
+
+        vector<LoadIssue> issues;
+        snap = loadSnapshot(difficulty, issues);
+        reportLoadIssues(issues, cout);
+        return publishFirst(difficulty, snap);
+    }
+
+    // Startup: all difficulty files load at once, each split across cores by loadBankFile.
+    void loadAll(ostream& report)
+    {
+        BankRef loaded[3];
+        vector<LoadIssue> issues[3];
+        vector<thread> threads;
+        for (int d = 0; d < 3; d++)
+        {
+            threads.emplace_back([&, d] { loaded[d] = loadSnapshot(d, issues[d]); });
+        }
+        for (thread& t : threads) t.join();
+        for (int d = 0; d < 3; d++)
+        {
+            reportLoadIssues(issues[d], report);
+            publishFirst(d, loaded[d]);
+        }
+    }
+
+    // Writers are serialized. edit works on a private copy; the file is replaced before the new
+    // version is published, so a failed write publishes nothing. With expectedVersion set, the
+    // edit is refused if someone else published after the caller took its snapshot. afterWrite
+    // runs in the same lock hold, so no other writer sees the new file before it is done.
+    BankUpdate update(int difficulty, const function<void(vector<CFG>&)>& edit, unsigned long long expectedVersion = 0,
+                      const function<void()>& afterWrite = nullptr)
+    {
+        current(difficulty);
+        lock_guard<mutex> lock(writer);
+        BankRef old = atomic_load(&slots[difficulty]);
+        if (expectedVersion != 0 && old->version != expectedVersion) return BANK_CONFLICT;
+
+        auto next = make_shared<BankSnapshot>(*old);
+        next->version = old->version + 1;
+        edit(next->grammars);
+        if (!writeGrammarArrayToFile(next->file, next->grammars, next->rejected)) return BANK_WRITE_FAILED;
+        atomic_store(&slots[difficulty], BankRef(next));
+        if (afterWrite) afterWrite();
+        return BANK_UPDATED;
+    }
+
+    // Runs work under the writer lock, for whatever reads the bank files and must not see one
+    // half-written or race another copy of itself (the index rebuild and its .tmp file).
+    template <class Work>
+    auto exclusive(Work work)
+    {
+        lock_guard<mutex> lock(writer);
+        return work();
+    }
+
+private:
+    BankRef slots[3];
+    mutex writer;
+
+    static BankRef loadSnapshot(int difficulty, vector<LoadIssue>& issues)
+    {
+        auto fresh = make_shared<BankSnapshot>();
+        fresh->file = BANK_FILES[difficulty];
+        fresh->version = 1;
+        loadBankFile(fresh->file, fresh->grammars, issues, fresh->rejected);
+        return fresh;
+    }
+
+    // Loads can race; the first one published wins and the others are dropped.
+    BankRef publishFirst(int difficulty, BankRef snap)
+    {
+        lock_guard<mutex> lock(writer);
+        BankRef existing = atomic_load(&slots[difficulty]);
+        if (existing) return existing;
+        atomic_store(&slots[difficulty], snap);
+        return snap;
+    }
+};
+
+GrammarBank grammarBank;
+
+// ---------------------------------------------------------------------------------------------
+// Bank index. cfg_index.txt records, for every grammar of every shard file, where it starts and
+// what it is like, sorted by (difficulty, flags). A filtered pick is a handful of binary
+// searches plus one seek into a shard, so cost stays flat as banks grow and only the picked
+// grammars are loaded. Shards of a difficulty are the base file plus easy_cfgs_1.txt, ... .
+// ---------------------------------------------------------------------------------------------
+
+const string BANK_INDEX_FILE = "cfg_index.txt";
+const int BANK_INDEX_VERSION = 3; // an index written by another version is rebuilt, not read
+enum BankFlag
+{
+    BANK_AMBIGUOUS = 1, // some string up to ENUM_LIMIT has two parse trees in the original rules
+    BANK_REGULAR = 2,
+    BANK_LL1 = 4
+};
+
+struct IndexEntry
+{
+    int difficulty = 0;
+    int flags = 0;
+    int shard = 0;        // index into BankIndex::shardFiles
+    long long offset = 0; // byte offset of the START line
+    uint64_t checksum = 0;  // blockChecksum of the block at offset when the index was built
+    int rules = 0;
+    int minLength = -1;
+    long long stringsUpTo = 0;  // distinct strings of length <= enumeratedUpTo
+    int enumeratedUpTo = -1;    // longest length fully enumerated; stops below ENUM_LIMIT on big alphabets
+    double derivationsUpTo = 0; // derivations of length <= ESTIMATE_LIMIT (language size estimate)
+
+    int key() const { return difficulty * 8 + flags; }
+};
+
+// -1 in a field means "any".
+struct BankFilter
+{
+    int difficulty = -1;
+    int ambiguous = -1;
+    int regular = -1;
+    int ll1 = -1;
+
+    bool matches(int key) const
+    {
+        int d = key / 8, f = key % 8;
+        return (difficulty < 0 || d == difficulty) && (ambiguous < 0 || ((f & BANK_AMBIGUOUS) != 0) == (ambiguous == 1))
+            && (regular < 0 || ((f & BANK_REGULAR) != 0) == (regular == 1)) && (ll1 < 0 || ((f & BANK_LL1) != 0) == (ll1 == 1));
+    }
+};
+
+// Tags as typed by the student after the difficulty, e.g. "hard,non-regular,unambiguous".
+bool parseBankTags(const string& tags, BankFilter& f)
+{
+    istringstream ss(tags);
+    string tag;
+    while (getline(ss, tag, ','))
+    {
+        if (tag == "ambiguous") f.ambiguous = 1;
+        else if (tag == "unambiguous") f.ambiguous = 0;
+        else if (tag == "regular") f.regular = 1;
+        else if (tag == "non-regular") f.regular = 0;
+        else if (tag == "ll1") f.ll1 = 1;
+        else if (tag == "non-ll1") f.ll1 = 0;
+        else if (!tag.empty()) return false;
+    }
+    return true;
+}
+
+// Parse trees of s under rules, saturated at 2. count[A][i][j] counts trees of A over s[i, j);
+// a span is iterated to a fixed point because empty and unit rules let a tree of A over s[i, j)
+// contain another tree over the same span, and such a cycle means infinitely many trees.
+int countParseTrees(const map<string, Production>& rules, const string& start, const string& s)
+{
+    int n = s.size();
+    map<string, int> ntId;
+    for (const auto& [name, prod] : rules) ntId.insert({name, (int)ntId.size()});
+    if (!ntId.count(start)) return 0;
+    int N = ntId.size();
+    vector<int> count(N * (n + 1) * (n + 1), 0);
+    auto at = [&](int A, int i, int j) -> int& { return count[(A * (n + 1) + i) * (n + 1) + j]; };
+
+    // Trees of alt over s[i, j), with every symbol's count read from the current table.
+    auto altCount = [&](const string& alt, int i, int j)
+    {
+        vector<int> ways(j - i + 1, 0), next(j - i + 1);
+        ways[0] = 1;
+        for (char c : alt)
+        {
+            auto nt = ntId.find(string(1, c));
+            fill(next.begin(), next.end(), 0);
+            for (int m = 0; m <= j - i; m++)
+            {
+                if (!ways[m]) continue;
+                for (int k = m; k <= j - i; k++)
+                {
+                    int w = nt != ntId.end() ? at(nt->second, i + m, i + k) : (k == m + 1 && s[i + m] == c);
+                    if (w) next[k] = min(2, next[k] + ways[m] * w);
+                }
+            }
+            swap(ways, next);
+        }
+        return ways[j - i];
+    };
+
+    for (int len = 0; len <= n; len++)
+    {
+        for (int i = 0; i + len <= n; i++)
+        {
+            for (bool changed = true; changed; )
+            {
+                changed = false;
+                for (const auto& [name, prod] : rules)
+                {
+                    int A = ntId[name], total = 0;
+                    for (const string& alt : prod.rhs) total = min(2, total + altCount(alt, i, i + len));
+                    if (total != at(A, i, i + len))
+                    {
+                        at(A, i, i + len) = total;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+    return at(ntId[start], 0, n);
+}
+
+IndexEntry describeGrammar(const CFG& g)
+{
+    const int ENUM_LIMIT = 6, ESTIMATE_LIMIT = 12, ENUM_MAX_STRINGS = 4096;
+    IndexEntry e;
+    GrammarInfo info = analyzeGrammar(g);
+    e.rules = info.nonTerminals.size();
+    e.minLength = info.minLength;
+    if (info.regular) e.flags |= BANK_REGULAR;
+    if (info.ll1) e.flags |= BANK_LL1;
+
+    GenConstraints all;
+    all.maxLength = ESTIMATE_LIMIT;
+    ConstrainedSampler sampler(g.getRules(), g.getStartSymbol(), all);
+    e.derivationsUpTo = sampler.count();
+
+    // Bounded ambiguity check: a member up to ENUM_LIMIT with two parse trees. The sampler's
+    // derivation counts cannot show this, since its normal form merges equal alternatives.
+    string alphabet(info.terminals.begin(), info.terminals.end());
+    long long strings = 1;
+    for (int n = 0; n <= ENUM_LIMIT && !alphabet.empty(); n++)
+    {
+        if (n > 0) strings *= alphabet.size();
+        if (strings > ENUM_MAX_STRINGS) break;
+        long long members = 0;
+        string s(n, alphabet[0]);
+        for (long long k = 0; k < strings; k++)
+        {
+            long long code = k;
+            for (int i = 0; i < n; i++, code /= alphabet.size()) s[i] = alphabet[code % alphabet.size()];
+            if (!g.isValidString(s)) continue;
+            members++;
+            if (!(e.flags & BANK_AMBIGUOUS) && countParseTrees(g.getRules(), g.getStartSymbol(), s) > 1) e.flags |= BANK_AMBIGUOUS;
+        }
+        e.stringsUpTo += members;
+        e.enumeratedUpTo = n;
+    }
+    return e;
+}
+
+class BankIndex
+{
+public:
+    vector<string> shardFiles;
+
+    // Scans every shard, analyzes each grammar and writes the sorted index. Blocks are checked by
+    // parseGrammarBlock like a bank load; the ones it rejects are left out and counted in skipped.
+    static bool build(const string& filename = BANK_INDEX_FILE, int* skipped = nullptr)
+    {
+        if (skipped) *skipped = 0;
+        BankIndex idx;
+        for (int d = 0; d < 3; d++)
+        {
+            string base = BANK_FILES[d];
+            for (int k = 0; ; k++)
+            {
+                string shard = k == 0 ? base : base.substr(0, base.size() - 4) + "_" + to_string(k) + ".txt";
+                ifstream in(shard, ios::binary);
+                if (!in) break;
+                int shardId = idx.shardFiles.size();
+                idx.shardFiles.push_back(shard);
+                vector<string> lines;
+                vector<long long> offsets;
+                vector<int> starts;
+                string line;
+                for (long long pos = in.tellg(); getline(in, line); pos = in.tellg())
+                {
+                    if (!line.empty() && line.back() == '\r') line.pop_back();
+                    if (line.compare(0, 6, "START ") == 0) starts.push_back(lines.size());
+                    lines.push_back(line);
+                    offsets.push_back(pos);
+                }
+                starts.push_back(lines.size());
+                for (size_t k = 0; k + 1 < starts.size(); k++)
+                {
+                    CFG g("S");
+                    vector<LoadIssue> issues;
+                    if (!parseGrammarBlock(lines, starts[k], starts[k + 1], shard, g, issues))
+                    {
+                        if (skipped) ++*skipped;
+                        continue;
+                    }
+                    IndexEntry e = describeGrammar(g);
+                    e.difficulty = d;
+                    e.shard = shardId;
+                    e.offset = offsets[starts[k]];
+                    e.checksum = blockChecksum(lines, starts[k], starts[k + 1]);
+                    idx.entries.push_back(e);
+                }
+            }
+        }
+        sort(idx.entries.begin(), idx.entries.end(), [](const IndexEntry& a, const IndexEntry& b) { return a.key() < b.key(); });
+
+        ofstream out(filename + ".tmp");
+        out << "INDEX " << BANK_INDEX_VERSION << " " << idx.shardFiles.size() << " " << idx.entries.size() << "\n";
+        for (const string& s : idx.shardFiles) out << s << "\n";
+        for (const IndexEntry& e : idx.entries)
+        {
+            out << e.difficulty << " " << e.flags << " " << e.shard << " " << e.offset << " " << e.checksum << " " << e.rules << " "
+                << e.minLength << " " << e.stringsUpTo << " " << e.enumeratedUpTo << " " << e.derivationsUpTo << "\n";
+        }
+        out.close();
+        return out && replaceFile(filename + ".tmp", filename);
+    }
+
+    bool load(const string& filename = BANK_INDEX_FILE)
+    {
+        ifstream in(filename);
+        string word;
+        int version;
+        size_t shards, count;
+        if (!(in >> word >> version >> shards >> count) || word != "INDEX" || version != BANK_INDEX_VERSION) return false;
+        shardFiles.assign(shards, "");
+        for (string& s : shardFiles) in >> s;
+        entries.assign(count, IndexEntry());
+        for (IndexEntry& e : entries)
+        {
+            in >> e.difficulty >> e.flags >> e.shard >> e.offset >> e.checksum >> e.rules >> e.minLength >> e.stringsUpTo >> e.enumeratedUpTo >> e.derivationsUpTo;
+        }
+        return !in.fail();
+    }
+
+    size_t count(const BankFilter& f) const
+    {
+        size_t total = 0;
+        for (auto& [lo, hi] : ranges(f)) total += hi - lo;
+        return total;
+    }
+
+    // Uniform pick among the entries matching f: at most 24 key ranges, two binary searches each.
+    bool sample(const BankFilter& f, mt19937& rng, IndexEntry& out) const
+    {
+        vector<pair<size_t, size_t>> rs = ranges(f);
+        size_t total = 0;
+        for (auto& [lo, hi] : rs) total += hi - lo;
+        if (total == 0) return false;
+        size_t pick = rng() % total;
+        for (auto& [lo, hi] : rs)
+        {
+            if (pick < hi - lo)
+            {
+                out = entries[lo + pick];
+                return true;
+            }
+            pick -= hi - lo;
+        }
+        return false;
+    }
+
+    // Reads the block at e's offset, up to its END or the next START, through parseGrammarBlock.
+    // Readers take no lock, so the shard may have been rewritten since this index was loaded; a
+    // block whose checksum no longer matches is refused instead of parsed.
+    bool loadGrammar(const IndexEntry& e, CFG& g) const
+    {
+        ifstream in(shardFiles[e.shard], ios::binary);
+        in.seekg(e.offset);
+        vector<string> lines;
+        string line;
+        while (getline(in, line))
+        {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (lines.empty() ? line.compare(0, 6, "START ") != 0 : line.compare(0, 6, "START ") == 0)
+            {
+                if (lines.empty()) return false; // not a grammar's start; the index is out of date
+                break;
+            }
+            lines.push_back(line);
+            if (line == "END") break;
+        }
+        if (lines.empty() || blockChecksum(lines, 0, lines.size()) != e.checksum) return false;
+        vector<LoadIssue> issues;
+        return parseGrammarBlock(lines, 0, lines.size(), shardFiles[e.shard], g, issues);
+    }
+
+private:
+    vector<IndexEntry> entries; // sorted by key()
+
+    // fnv1a of lines[begin, end) up to and including the first END line.
+    static uint64_t blockChecksum(const vector<string>& lines, int begin, int end)
+    {
+        uint64_t h = fnv1a("");
+        for (int i = begin; i < end; i++)
+        {
+            h = fnv1a(lines[i] + "\n", h);
+            if (lines[i] == "END") break;
+        }
+        return h;
+    }
+
+    vector<pair<size_t, size_t>> ranges(const BankFilter& f) const
+    {
+        vector<pair<size_t, size_t>> rs;
+        for (int key = 0; key < 24; key++)
+        {
+            if (!f.matches(key)) continue;
+            auto lo = lower_bound(entries.begin(), entries.end(), key, [](const IndexEntry& e, int k) { return e.key() < k; });
+            auto hi = upper_bound(lo, entries.end(), key, [](int k, const IndexEntry& e) { return k < e.key(); });
+            if (lo != hi) rs.push_back({size_t(lo - entries.begin()), size_t(hi - entries.begin())});
+        }
+        return rs;
+    }
+};
+
+const int QUIZ_WORKING_SET = 16; // grammars pulled from the index for one quiz
+
+// The grammars one quiz works from, or null. With an index, a private random working set matching
+// the filter is drawn from seed; without one, the quiz shares the published snapshot of the whole
+// bank (and tags cannot be honoured).
+BankRef loadQuizBank(int difficulty_rank, const string& tags, uint32_t seed)
+{
+    BankFilter filter;
+    filter.difficulty = difficulty_rank;
+    if (!parseBankTags(tags, filter))
+    {
+        cout << "Unknown tag in '" << tags << "' (use regular, non-regular, ambiguous, unambiguous, ll1, non-ll1)." << endl;
+        return nullptr;
+    }
+
+    BankIndex index;
+    if (!index.load())
+    {
+        if (!tags.empty()) cout << "No usable " << BANK_INDEX_FILE << "; rebuild it from the Admin menu to filter by tags." << endl;
+        BankRef bank = grammarBank.current(difficulty_rank);
+        return bank->grammars.empty() ? nullptr : bank;
+    }
+
+    auto working = make_shared<BankSnapshot>();
+    working->file = BANK_FILES[difficulty_rank];
+    mt19937 rng(seed);
+    size_t available = index.count(filter);
+    set<pair<int, long long>> taken;
+    for (int attempt = 0; attempt < 4 * QUIZ_WORKING_SET && taken.size() < min<size_t>(available, QUIZ_WORKING_SET); attempt++)
+    {
+        IndexEntry e;
+        CFG g("S");
+        if (index.sample(filter, rng, e) && taken.insert({e.shard, e.offset}).second && index.loadGrammar(e, g)) working->grammars.push_back(g);
+    }
+    if (working->grammars.empty())
+    {
+        cout << "No grammar matches that filter." << endl;
+        return nullptr;
+    }
+    return working;
+}
+
+// Passed to GrammarBank::update: offsets in the rewritten file have moved, so an existing index
+// is rebuilt before the writer lock is let go.
+void refreshBankIndex()
+{
+    if (ifstream(BANK_INDEX_FILE)) BankIndex::build();
+}
+
+void Rebuild_Index()
+{
+    int skipped = 0;
+    if (grammarBank.exclusive([&] { return BankIndex::build(BANK_INDEX_FILE, &skipped); }))
+    {
+        BankIndex index;
+        index.load();
+        cout << "Indexed " << index.count(BankFilter()) << " grammars into " << BANK_INDEX_FILE << endl;
+        if (skipped > 0) cout << skipped << " invalid grammar blocks were left out; the bank load reports why." << endl;
+    }
+    else
+    {
+        cout << "Could not write " << BANK_INDEX_FILE << endl;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Symbol-level grammars. Unlike CFG, symbols are whole words: non-terminals are rule names,
+// terminals are quoted literals ("if", "+=") or token classes declared with TOKEN. Input text is
+// first turned into token ids by a DFA lexer, and the Earley parser works on token ids, so
+// realistic expression/statement grammars can be quizzed.
+//
+//     SYMBOLIC arithmetic
+//     TOKEN num [0-9]+
+//     TOKEN id [a-z_][a-z0-9_]*
+//     START Expr
+//     RULES 3
+//     Expr -> Expr "+" Term | Term
+//     Term -> Term "*" Factor | Factor
+//     Factor -> "(" Expr ")" | id | num
+//     END
+// ---------------------------------------------------------------------------------------------
+
+// One step of a token pattern: a character set repeated per its quantifier ('\0', '?', '*', '+').
+struct PatternAtom
+{
+    bitset<256> chars;
+    char quant = 0;
+};
+
+// Patterns are sequences of literal characters, \-escapes and [a-z0-9_] sets, each optionally
+// followed by ?, * or +. Returns false on malformed input.
+bool parseTokenPattern(const string& pat, vector<PatternAtom>& atoms)
+{
+    for (size_t i = 0; i < pat.size(); )
+    {
+        PatternAtom atom;
+        if (pat[i] == '[')
+        {
+            size_t close = pat.find(']', i + 1);
+            if (close == string::npos || close == i + 1) return false;
+            for (size_t k = i + 1; k < close; k++)
+            {
+                if (k + 2 < close && pat[k+1] == '-')
+                {
+                    for (int c = (unsigned char)pat[k]; c <= (unsigned char)pat[k+2]; c++) atom.chars.set(c);
+                    k += 2;
+                }
+                else
+                {
+                    atom.chars.set((unsigned char)pat[k]);
+                }
+            }
+            i = close + 1;
+        }
+        else if (pat[i] == '\\' && i + 1 < pat.size())
+        {
+            atom.chars.set((unsigned char)pat[i+1]);
+            i += 2;
+        }
+        else if (pat[i] == '?' || pat[i] == '*' || pat[i] == '+')
+        {
+            return false;
+        }
+        else
+        {
+            atom.chars.set((unsigned char)pat[i++]);
+        }
+        if (i < pat.size() && (pat[i] == '?' || pat[i] == '*' || pat[i] == '+')) atom.quant = pat[i++];
+        atoms.push_back(atom);
+    }
+    return !atoms.empty();
+}
+
+// Maximal-munch lexer compiled from literal terminals and token patterns into one DFA
+// (Thompson NFA + subset construction). On equal length a literal wins over a pattern, so
+// keywords are not lexed as identifiers; patterns are ranked by declaration order.
+class TokenLexer
+{
+public:
+    struct Rule
+    {
+        int token;
+        string literal;              // used when atoms is empty
+        vector<PatternAtom> atoms;
+    };
+
+    void build(const vector<Rule>& rules)
+    {
+        nfa.assign(1, NfaState());
+        for (int r = 0; r < (int)rules.size(); r++)
+        {
+            int s = newState();
+            nfa[0].eps.push_back(s);
+            if (rules[r].atoms.empty())
+            {
+                for (char ch : rules[r].literal)
+                {
+                    int t = newState();
+                    bitset<256> one;
+                    one.set((unsigned char)ch);
+                    nfa[s].edges.push_back({one, t});
+                    s = t;
+                }
+            }
+            else
+            {
+                for (const PatternAtom& atom : rules[r].atoms)
+                {
+                    int t = newState();
+                    if (atom.quant == '*' || atom.quant == '?') nfa[s].eps.push_back(t);
+                    if (atom.quant == '*') nfa[t].edges.push_back({atom.chars, t});
+                    else nfa[s].edges.push_back({atom.chars, t});
+                    if (atom.quant == '+') nfa[t].edges.push_back({atom.chars, t});
+                    int next = newState();
+                    nfa[t].eps.push_back(next);
+                    s = next;
+                }
+            }
+            nfa[s].accept = r;
+        }
+        ruleToken.clear();
+        rulePriority.clear();
+        for (int r = 0; r < (int)rules.size(); r++)
+        {
+            ruleToken.push_back(rules[r].token);
+            rulePriority.push_back(rules[r].atoms.empty() ? r : (int)rules.size() + r);
+        }
+
+        dfa.clear();
+        dfaAccept.clear();
+        map<vector<int>, int> ids;
+        vector<vector<int>> sets = { closure({0}) };
+        ids[sets[0]] = 0;
+        for (int d = 0; d < (int)sets.size(); d++)
+        {
+            dfa.push_back(vector<int>(256, -1));
+            int best = -1;
+            for (int s : sets[d])
+            {
+                int r = nfa[s].accept;
+                if (r >= 0 && (best < 0 || rulePriority[r] < rulePriority[best])) best = r;
+            }
+            dfaAccept.push_back(best < 0 ? -1 : ruleToken[best]);
+            for (int c = 0; c < 256; c++)
+            {
+                vector<int> moved;
+                for (int s : sets[d])
+                {
+                    for (auto& [chars, t] : nfa[s].edges)
+                    {
+                        if (chars.test(c)) moved.push_back(t);
+                    }
+                }
+                if (moved.empty()) continue;
+                vector<int> next = closure(moved);
+                auto ins = ids.insert({next, (int)sets.size()});
+                if (ins.second) sets.push_back(next);
+                dfa[d][c] = ins.first->second;
+            }
+        }
+        nfa.clear();
+    }
+
+    // Splits text into token ids (whitespace separates tokens and is otherwise ignored).
+    // On failure returns false and sets errorPos to the offending character.
+    bool lex(const string& text, vector<int>& tokens, vector<string>* lexemes, size_t& errorPos) const
+    {
+        size_t i = 0, n = text.size();
+        while (true)
+        {
+            while (i < n && isspace((unsigned char)text[i])) i++;
+            if (i == n) return true;
+            int state = 0, lastToken = -1;
+            size_t lastEnd = i;
+            for (size_t k = i; k < n && state >= 0; k++)
+            {
+                state = dfa[state][(unsigned char)text[k]];
+                if (state >= 0 && dfaAccept[state] >= 0)
+                {
+                    lastToken = dfaAccept[state];
+                    lastEnd = k + 1;
+                }
+            }
+            if (lastToken < 0)
+            {
+                errorPos = i;
+                return false;
+            }
+            tokens.push_back(lastToken);
+            if (lexemes) lexemes->push_back(text.substr(i, lastEnd - i));
+            i = lastEnd;
+        }
+    }
+
+private:
+    struct NfaState
+    {
+        vector<pair<bitset<256>, int>> edges;
+        vector<int> eps;
+        int accept = -1;
+    };
+    vector<NfaState> nfa;
+    vector<int> ruleToken, rulePriority;
+    vector<vector<int>> dfa; // dfa[state][byte] = next state or -1
+    vector<int> dfaAccept;   // token id accepted in a state, or -1
+
+    int newState()
+    {
+        nfa.push_back(NfaState());
+        return nfa.size() - 1;
+    }
+
+    vector<int> closure(vector<int> states) const
+    {
+        vector<bool> in(nfa.size(), false);
+        for (int s : states) in[s] = true;
+        for (size_t k = 0; k < states.size(); k++)
+        {
+            for (int t : nfa[states[k]].eps)
+            {
+                if (!in[t])
+                {
+                    in[t] = true;
+                    states.push_back(t);
+                }
+            }
+        }
+        sort(states.begin(), states.end());
+        return states;
+    }
+};
+
+class SymbolGrammar
+{
+public:
+    string name;
+
+    // Reads the lines after a "SYMBOLIC name" header up to END. lineNo is advanced; on failure
+    // error holds "line N: why".
+    bool read(istream& in, int& lineNo, string& error)
+    {
+        string line;
+        vector<pair<string, vector<vector<string>>>> rawRules;
+        vector<pair<string, string>> tokenDefs;
+        string startName;
+        int ruleCount = -1, rulesLine = 0;
+        auto fail = [&](const string& why) { error = "line " + to_string(lineNo) + ": " + why; return false; };
+
+        while (getline(in, line))
+        {
+            lineNo++;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            istringstream ss(line);
+            string word;
+            if (!(ss >> word)) continue;
+            if (word == "END") break;
+            if (word == "TOKEN")
+            {
+                string tokName, pattern;
+                if (!(ss >> tokName) || !getline(ss >> ws, pattern) || pattern.empty()) return fail("TOKEN needs a name and a pattern");
+                tokenDefs.push_back({tokName, pattern});
+            }
+            else if (word == "START") ss >> startName;
+            else if (word == "RULES")
+            {
+                if (!(ss >> ruleCount) || ruleCount < 0) return fail("expected 'RULES <count>'");
+                rulesLine = lineNo;
+            }
+            else
+            {
+                string lhs = word, arrow;
+                if (!(ss >> arrow) || arrow != "->") return fail("expected 'Name -> alternatives'");
+                vector<vector<string>> alts(1);
+                while (ss >> word)
+                {
+                    if (word == "|") alts.push_back({});
+                    else if (word != "empty") alts.back().push_back(word);
+                }
+                rawRules.push_back({lhs, alts});
+            }
+        }
+        if (rawRules.empty()) return fail("grammar has no rules");
+        if (ruleCount < 0) return fail("expected 'RULES <count>' before END");
+        if ((int)rawRules.size() != ruleCount)
+        {
+            lineNo = rulesLine;
+            return fail("RULES says " + to_string(ruleCount) + " but " + to_string(rawRules.size()) + " rule lines follow");
+        }
+
+        for (auto& [lhs, alts] : rawRules) symbolId(lhs, false);
+        vector<TokenLexer::Rule> lexRules;
+        for (auto& [tokName, pattern] : tokenDefs)
+        {
+            if (findSymbol(tokName) >= 0) return fail("token " + tokName + " is defined twice or is also a rule");
+            TokenLexer::Rule r;
+            r.token = symbolId(tokName, true);
+            if (!parseTokenPattern(pattern, r.atoms)) return fail("bad pattern for token " + tokName);
+            tokenAtoms[r.token] = r.atoms;
+            tokenPatterns[r.token] = pattern;
+            lexRules.push_back(r);
+        }
+        for (auto& [lhs, alts] : rawRules)
+        {
+            for (auto& alt : alts)
+            {
+                SymRule rule;
+                rule.lhs = findSymbol(lhs);
+                for (const string& w : alt)
+                {
+                    if (w.size() >= 3 && w.front() == '"' && w.back() == '"')
+                    {
+                        string lit = w.substr(1, w.size() - 2);
+                        int id = findSymbol(w);
+                        if (id < 0)
+                        {
+                            id = symbolId(w, true);
+                            TokenLexer::Rule r;
+                            r.token = id;
+                            r.literal = lit;
+                            lexRules.push_back(r);
+                        }
+                        rule.rhs.push_back(id);
+                    }
+                    else
+                    {
+                        int id = findSymbol(w);
+                        if (id < 0) return fail("undefined symbol " + w + " in rule for " + lhs);
+                        rule.rhs.push_back(id);
+                    }
+                }
+                byLhs[rule.lhs].push_back(rules.size());
+                rules.push_back(rule);
+            }
+        }
+        start = findSymbol(startName.empty() ? rawRules[0].first : startName);
+        if (start < 0 || isTerminal(start)) return fail("start symbol is not a rule");
+
+        lexer.build(lexRules);
+        computeTables();
+        string unproductive;
+        for (int s = 0; s < (int)names.size(); s++)
+        {
+            if (!terminal[s] && minHeight[s] == INF_HEIGHT) unproductive += " " + names[s];
+        }
+        if (!unproductive.empty()) return fail("rules that derive no sentence:" + unproductive);
+        return true;
+    }
+
+    bool isTerminal(int sym) const { return terminal[sym]; }
+    const string& symbolName(int sym) const { return names[sym]; }
+
+    bool tokenize(const string& text, vector<int>& tokens, size_t& errorPos) const
+    {
+        return lexer.lex(text, tokens, nullptr, errorPos);
+    }
+
+    bool isValidString(const string& text)
+    {
+        Budget unlimited;
+        return isValidString(text, unlimited).value;
+    }
+
+    OpResult<bool> isValidString(const string& text, Budget& budget)
+    {
+        vector<int> tokens;
+        size_t errorPos;
+        if (!tokenize(text, tokens, errorPos)) return {OpStatus::Ok, false};
+        return isValidTokens(tokens, budget);
+    }
+
+    // Earley recognizer over token ids. Items are (rule, dot, origin); completion looks up the
+    // items waiting on a non-terminal in their origin set, and nullable non-terminals are
+    // stepped over at prediction time (Aycock-Horspool), so work is linear for the
+    // unambiguous LR-style grammars used in the quiz.
+    OpResult<bool> isValidTokens(const vector<int>& tokens, Budget& budget)
+    {
+        int n = tokens.size();
+        struct Item { int rule, dot, origin; };
+        vector<vector<Item>> sets(n + 1);
+        vector<unordered_set<uint64_t>> seen(n + 1);
+        vector<vector<vector<Item>>> waiting(n + 1); // waiting[k][A]: items of set k with dot before A
+        vector<char> predicted(names.size());
+
+        auto add = [&](int k, Item it)
+        {
+            uint64_t key = ((uint64_t)it.rule << 40) | ((uint64_t)it.dot << 32) | (uint32_t)it.origin;
+            if (seen[k].insert(key).second) sets[k].push_back(it);
+        };
+        for (int r : byLhs[start]) add(0, {r, 0, 0});
+
+        for (int k = 0; k <= n; k++)
+        {
+            waiting[k].assign(names.size(), {});
+            fill(predicted.begin(), predicted.end(), 0);
+            for (size_t idx = 0; idx < sets[k].size(); idx++)
+            {
+                if (!budget.step()) return {budget.status, false};
+                Item it = sets[k][idx];
+                const SymRule& rule = rules[it.rule];
+                if (it.dot < (int)rule.rhs.size())
+                {
+                    int sym = rule.rhs[it.dot];
+                    if (terminal[sym])
+                    {
+                        if (k < n && tokens[k] == sym) add(k + 1, {it.rule, it.dot + 1, it.origin});
+                        continue;
+                    }
+                    waiting[k][sym].push_back(it);
+                    if (!predicted[sym])
+                    {
+                        predicted[sym] = 1;
+                        for (int r : byLhs[sym]) add(k, {r, 0, k});
+                    }
+                    if (nullable[sym]) add(k, {it.rule, it.dot + 1, it.origin});
+                }
+                else
+                {
+                    const vector<Item>& parents = waiting[it.origin][rule.lhs];
+                    for (size_t p = 0; p < parents.size(); p++)
+                    {
+                        Item parent = parents[p];
+                        add(k, {parent.rule, parent.dot + 1, parent.origin});
+                    }
+                }
+            }
+            if (k < n && sets[k + 1].empty()) return {OpStatus::Ok, false};
+            seen[k].clear();
+        }
+        for (const Item& it : sets[n])
+        {
+            if (it.origin == 0 && rules[it.rule].lhs == start && it.dot == (int)rules[it.rule].rhs.size()) return {OpStatus::Ok, true};
+        }
+        return {OpStatus::Ok, false};
+    }
+
+    // Random sentence as token ids; once depth runs out, the lowest alternative is taken.
+    vector<int> generateTokens(int maxDepth, mt19937& rng) const
+    {
+        vector<int> out;
+        expand(start, maxDepth, rng, out);
+        return out;
+    }
+
+    // Spells token ids as text, inventing lexemes for token classes. False if some token class
+    // yielded no lexeme of its own; the caller draws another sentence.
+    bool spell(const vector<int>& tokens, mt19937& rng, string& text) const
+    {
+        text.clear();
+        string lexeme;
+        for (int t : tokens)
+        {
+            if (!lexemeFor(t, rng, lexeme)) return false;
+            if (!text.empty()) text += ' ';
+            text += lexeme;
+        }
+        return true;
+    }
+
+    bool generateString(int maxDepth, mt19937& rng, string& out) const
+    {
+        return spell(generateTokens(maxDepth, rng), rng, out);
+    }
+
+    vector<int> terminals() const
+    {
+        vector<int> out;
+        for (int s = 0; s < (int)names.size(); s++)
+        {
+            if (terminal[s]) out.push_back(s);
+        }
+        return out;
+    }
+
+    friend ostream& operator<<(ostream& os, const SymbolGrammar& g);
+
+private:
+    struct SymRule
+    {
+        int lhs;
+        vector<int> rhs;
+    };
+
+    vector<string> names;
+    vector<bool> terminal;
+    map<string, int> ids;
+    vector<SymRule> rules;
+    map<int, vector<int>> byLhs;
+    map<int, vector<PatternAtom>> tokenAtoms;
+    map<int, string> tokenPatterns;
+    vector<bool> nullable;
+    vector<int> minHeight; // of the lowest derivation tree; 0 for a terminal, INF_HEIGHT if none
+    int start = -1;
+
+    static constexpr int INF_HEIGHT = 1 << 20;
+    TokenLexer lexer;
+
+    int findSymbol(const string& s) const
+    {
+        auto it = ids.find(s);
+        return it == ids.end() ? -1 : it->second;
+    }
+
+    int symbolId(const string& s, bool isTerm)
+    {
+        int id = findSymbol(s);
+        if (id >= 0) return id;
+        ids[s] = names.size();
+        names.push_back(s);
+        terminal.push_back(isTerm);
+        return names.size() - 1;
+    }
+
+    void computeTables()
+    {
+        for (int s = 0; s < (int)names.size(); s++) byLhs[s];
+        nullable.assign(names.size(), false);
+        minHeight.assign(names.size(), INF_HEIGHT);
+        for (int s = 0; s < (int)names.size(); s++)
+        {
+            if (terminal[s]) minHeight[s] = 0;
+        }
+        for (bool changed = true; changed; )
+        {
+            changed = false;
+            for (int r = 0; r < (int)rules.size(); r++)
+            {
+                bool allNullable = true;
+                for (int sym : rules[r].rhs) allNullable = allNullable && !terminal[sym] && nullable[sym];
+                int lhs = rules[r].lhs;
+                if (allNullable && !nullable[lhs]) nullable[lhs] = changed = true;
+                int height = ruleHeight(r);
+                if (height < minHeight[lhs])
+                {
+                    minHeight[lhs] = height;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    void expand(int sym, int depth, mt19937& rng, vector<int>& out) const
+    {
+        if (terminal[sym])
+        {
+            out.push_back(sym);
+            return;
+        }
+        const vector<int>& alts = byLhs.at(sym);
+        int pick = alts[rng() % alts.size()];
+        if (depth <= 0)
+        {
+            // Every symbol of the lowest rule is lower than sym, so this ends; the shortest rule
+            // need not (L -> L L | empty).
+            for (int r : alts)
+            {
+                if (ruleHeight(r) < ruleHeight(pick)) pick = r;
+            }
+        }
+        for (int s : rules[pick].rhs) expand(s, depth - 1, rng, out);
+    }
+
+    int ruleHeight(int r) const
+    {
+        int height = 1;
+        for (int s : rules[r].rhs) height = max(height, min(INF_HEIGHT, minHeight[s] + 1));
+        return height;
+    }
+
+    // A token class lexeme is re-drawn until it lexes back to the same token, so an identifier
+    // pattern never produces a keyword. False if 20 draws all lexed as something else.
+    bool lexemeFor(int token, mt19937& rng, string& lexeme) const
+    {
+        auto atoms = tokenAtoms.find(token);
+        if (atoms == tokenAtoms.end())
+        {
+            lexeme = names[token].substr(1, names[token].size() - 2);
+            return true;
+        }
+        for (int attempt = 0; attempt < 20; attempt++)
+        {
+            lexeme.clear();
+            for (const PatternAtom& atom : atoms->second)
+            {
+                int reps = 1;
+                if (atom.quant == '?') reps = rng() % 2;
+                else if (atom.quant == '*') reps = rng() % 3;
+                else if (atom.quant == '+') reps = 1 + rng() % 3;
+                vector<char> choices;
+                for (int c = 32; c < 127; c++)
+                {
+                    if (atom.chars.test(c)) choices.push_back((char)c);
+                }
+                if (choices.empty()) continue;
+                for (int k = 0; k < reps; k++) lexeme += choices[rng() % choices.size()];
+            }
+            vector<int> back;
+            size_t errorPos;
+            if (lexer.lex(lexeme, back, nullptr, errorPos) && back.size() == 1 && back[0] == token) return true;
+        }
+        return false;
+    }
+};
+
+ostream& operator<<(ostream& os, const SymbolGrammar& g)
+{
+    for (const auto& [lhs, alts] : g.byLhs)
+    {
+        if (g.terminal[lhs]) continue;
+        os << g.names[lhs] << " ->";
+        for (size_t a = 0; a < alts.size(); a++)
+        {
+            const auto& rhs = g.rules[alts[a]].rhs;
+            os << (a ? " |" : "");
+            if (rhs.empty()) os << " empty";
+            for (int s : rhs) os << " " << g.names[s];
+        }
+        os << endl;
+    }
+    for (const auto& [token, pattern] : g.tokenPatterns) os << "Token " << g.names[token] << " : " << pattern << endl;
+    return os;
+}
+
+vector<SymbolGrammar> sym_arr; // symbolic bank of the current quiz
+
+bool readSymbolGrammarsFromFile(const string& filename, vector<SymbolGrammar>& out)
+{
+    ifstream inFile(filename);
+    if (!inFile) return false;
+    string line;
+    int lineNo = 0;
+    while (getline(inFile, line))
+    {
+        lineNo++;
+        istringstream ss(line);
+        string word;
+        if (!(ss >> word) || word != "SYMBOLIC") continue;
+        SymbolGrammar g;
+        ss >> g.name;
+        string error;
+        if (!g.read(inFile, lineNo, error))
+        {
+            cout << filename << ": " << error << endl;
+            return false;
+        }
+        out.push_back(g);
+    }
+    return true;
+}
+
+// Adapts a runtime CFG to the GrammarEngine interface shared with static_cfg::StaticEngine.
+class RuntimeEngine : public GrammarEngine
+{
+public:
+    explicit RuntimeEngine(const CFG& g) : cfg(g) {}
+    // Skips the prefilter and result cache, so repeated rounds time the recognizer, not lookups.
+    bool isValidString(const string& input) override { return cfg.recognizeUncached(input); }
+    string generateString(int maxDepth) override { return cfg.generateString(maxDepth); }
+    const char* engineName() const override { return "runtime CFG"; }
+
+private:
+    CFG cfg;
+};
+
+// Grammars shipped with the quiz, compiled into specialized recognizers and generators.
+constexpr char BUILTIN_ANBN[] = "START S\nRULES 1\nS -> S aSb empty\nEND\n";
+constexpr char BUILTIN_ANCN_BMDM[] = "START S\nRULES 3\nA -> A aAc empty\nB -> B bBd empty\nS -> S AB\nEND\n";
+constexpr char BUILTIN_ENDS_IN_A[] = "START S\nRULES 2\nB -> B bS\nS -> S aB bS cS dS empty\nEND\n";
+constexpr char BUILTIN_PALINDROME[] = "START S\nRULES 1\nS -> S aSa bSb cSc dSd empty\nEND\n";
+
+static constexpr static_cfg::Grammar builtinAnBn = static_cfg::parse(BUILTIN_ANBN);
+static constexpr static_cfg::Grammar builtinAncnBmdm = static_cfg::parse(BUILTIN_ANCN_BMDM);
+static constexpr static_cfg::Grammar builtinEndsInA = static_cfg::parse(BUILTIN_ENDS_IN_A);
+static constexpr static_cfg::Grammar builtinPalindrome = static_cfg::parse(BUILTIN_PALINDROME);
+
+static_assert(builtinAnBn.isLL1 && builtinAncnBmdm.isLL1 && builtinEndsInA.isLL1, "expected LL(1) built-ins");
+static_assert(!builtinPalindrome.isLL1, "palindromes exercise the span-table recognizer");
+
+// Times the runtime CFG against the compile-time engine of each built-in grammar on the same
+// inputs (generated members plus random strings over the alphabet) and reports disagreements.
+void Benchmark_Engines()
+{
+    struct Entry
+    {
+        const char* text;
+        const static_cfg::Grammar& grammar;
+        GrammarEngine* compiled;
+    };
+    static_cfg::StaticEngine<builtinAnBn> anbn;
+    static_cfg::StaticEngine<builtinAncnBmdm> ancn;
+    static_cfg::StaticEngine<builtinEndsInA> endsInA;
+    static_cfg::StaticEngine<builtinPalindrome> palindrome;
+    Entry entries[] =
+    {
+        {BUILTIN_ANBN, builtinAnBn, &anbn},
+        {BUILTIN_ANCN_BMDM, builtinAncnBmdm, &ancn},
+        {BUILTIN_ENDS_IN_A, builtinEndsInA, &endsInA},
+        {BUILTIN_PALINDROME, builtinPalindrome, &palindrome}
+    };
+
+    const int SAMPLES = 200, ROUNDS = 20;
+    mt19937 rng(12345);
+    for (Entry& e : entries)
+    {
+        istringstream text(e.text);
+        vector<string> lines;
+        for (string line; getline(text, line); ) lines.push_back(line);
+        CFG parsed("S");
+        vector<LoadIssue> issues;
+        parseGrammarBlock(lines, 0, lines.size(), "built-in", parsed, issues);
+        RuntimeEngine runtime(parsed);
+        GrammarEngine* engines[2] = { &runtime, e.compiled };
+
+        string alphabet(e.grammar.term, e.grammar.termCount);
+        vector<string> inputs;
+        for (int i = 0; i < SAMPLES; i++) inputs.push_back(runtime.generateString(6));
+        for (int i = 0; i < SAMPLES; i++)
+        {
+            string r;
+            int len = rng() % 11;
+            for (int k = 0; k < len; k++) r += alphabet[rng() % alphabet.size()];
+            inputs.push_back(r);
+        }
+
+        int disagreements = 0;
+        for (const string& in : inputs)
+        {
+            if (engines[0]->isValidString(in) != engines[1]->isValidString(in)) disagreements++;
+        }
+
+        cout << string(e.text).substr(0, string(e.text).find("\nEND")) << endl;
+        for (GrammarEngine* engine : engines)
+        {
+            auto t0 = chrono::steady_clock::now();
+            int accepted = 0;
+            for (int r = 0; r < ROUNDS; r++)
+            {
+                for (const string& in : inputs) accepted += engine->isValidString(in);
+            }
+            auto t1 = chrono::steady_clock::now();
+            for (int i = 0; i < SAMPLES; i++) engine->generateString(6);
+            auto t2 = chrono::steady_clock::now();
+            double recognizeNs = chrono::duration<double, nano>(t1 - t0).count() / (ROUNDS * inputs.size());
+            double generateNs = chrono::duration<double, nano>(t2 - t1).count() / SAMPLES;
+            cout << "  " << engine->engineName() << ": recognize " << recognizeNs << " ns/string, generate "
+                 << generateNs << " ns/string, accepted " << accepted / ROUNDS << "/" << inputs.size() << endl;
+        }
+        cout << "  disagreements: " << disagreements << endl << endl;
+    }
+}
+
+mutex leaderboardLock; // sessions of the load test finish on several threads
+
+void recordScore(int difficulty_rank, int points)
+{
+    lock_guard<mutex> lock(leaderboardLock);
+    leaderboard[difficulty_rank].insert(points);
+}
+
+void writeScoreFromFile()
+{
+    lock_guard<mutex> lock(leaderboardLock);
+    ofstream outFile("Scoreboard.txt");
+
+    for(int i=0; i<LEADERBOARDS;i++)
+    {
+       // outFile << "START\n";
+        for(int item : leaderboard[i])
+        {
+            outFile << item << " ";
+        }
+        outFile << "\n";
+       // outFile << "END\n";
+    }
+    outFile.close();
+    return;
+}
+
+void readScoreFromFile()
+{
+    ifstream inFile("Scoreboard.txt");
+    string line;
+    int i = 0;
+
+    while(getline(inFile, line) && i < LEADERBOARDS)
+    {
+        istringstream ss(line);
+        int item;
+        while(ss >> item)
+        {
+            leaderboard[i].insert(item);
+        }
+        i++;
+    }
+
+    inFile.close();
+}
+
+void Add_CFGs()
+{
+    string difficulty;
+    int difficulty_rank;
+    cout << "Select New CFG difficuly(easy,medium,hard) : ";
+    cin >> difficulty;
+    if(difficulty == "easy")
+    {
+        difficulty_rank = 0;
+    }
+    else if(difficulty == "medium")
+    {
+        difficulty_rank = 1;
+    }
+    else if(difficulty == "hard")
+    {
+        difficulty_rank = 2;
+    }
+    else
+    {
+        cout <<"Invalid Difficulty Option." << endl;
+        return;
+    }
+
+    string init;
+    int counter = 0;
+    vector<string> prod_rule;
+    vector<Production> productions;
+    CFG cfg("S");
+
+    cout << "Add Rules: " << endl;
+    while(1)
+    {
+        prod_rule.clear();
+        cout << "Enter Non-Terminal : ";
+        cin >> init;
+        if(init == "stop")
+        {
+            break;
+        }
+        while(1)
+        {
+            string str;
+            cout << "Product rule counter(empty for \"\") " << counter +1 << " : ";
+            cin >> str;
+            if(str == "next")
+            {
+                productions.push_back({init, prod_rule});
+                break;
+            }
+            if(str == "empty")
+            {
+                str = "";
+            }
+            prod_rule.push_back(str);
+            counter++;
+        }
+    }
+    cfg.addRules(productions);
+
+    if (grammarBank.update(difficulty_rank, [&](vector<CFG>& grammars) { grammars.push_back(cfg); }, 0, refreshBankIndex) != BANK_UPDATED)
+    {
+        cout << "Could not write " << BANK_FILES[difficulty_rank] << endl;
+        return;
+    }
+   
+    return;
+}
+
+void View_CFGs()
+{
+    string difficulty;
+    int difficulty_rank;
+    cout << "Select CFG difficuly to view(easy,medium,hard) : ";
+    cin >> difficulty;
+    if(difficulty == "easy")
+    {
+        difficulty_rank = 0;
+    }
+    else if(difficulty == "medium")
+    {
+        difficulty_rank = 1;
+    }
+    else if(difficulty == "hard")
+    {
+        difficulty_rank = 2;
+    }
+    else
+    {
+        cout <<"Invalid Difficulty Option." << endl;
+        return;
+    }
+    BankRef bank = grammarBank.current(difficulty_rank);
+    const vector<CFG>& cfg_arr = bank->grammars;
+    cout << endl;
+    for(int i=0;i<(int)cfg_arr.size();i++)
+    {
+        cout << i+1 << ". " << cfg_arr[i] << endl;
+    }
+
+    int opt;
+    cout << "Enter Index of CFG to delete(0 to exit) : ";
+    cin >> opt;
+
+    if(opt == 0)
+    {
+        return;
+    }
+    else if(opt <= (int)cfg_arr.size())
+    {
+        BankUpdate result = grammarBank.update(difficulty_rank, [&](vector<CFG>& grammars) { grammars.erase(grammars.begin() + opt-1); },
+                                               bank->version, refreshBankIndex);
+        if (result == BANK_CONFLICT)
+        {
+            cout << "The bank was changed by someone else meanwhile. Nothing removed, view it again." << endl;
+            return;
+        }
+        if (result == BANK_WRITE_FAILED)
+        {
+            cout << "Could not write " << BANK_FILES[difficulty_rank] << endl;
+            return;
+        }
+    }
+    else
+    {
+        cout << "Invalid Option. " << endl;
+        return;
+    }
+    
+}
+
+void Dump_Metrics()
+{
+    ResultCache::Stats cache = resultCache.stats();
+    cout << "Result cache: " << cache.hits << " hits, " << cache.misses << " misses, "
+         << cache.evictions << " evictions, " << cache.entries << " entries" << endl;
+#ifdef CFG_METRICS
+    ofstream prom("metrics.prom");
+    dumpMetricsPrometheus(prom);
+    ofstream json("metrics.json");
+    dumpMetricsJson(json);
+    cout << "Metrics written to metrics.prom and metrics.json" << endl;
+    if (metricRegistry().tracing)
+    {
+        ofstream trace("trace.json");
+        dumpTraceEvents(trace);
+        cout << "Trace events written to trace.json" << endl;
+    }
+#else
+    cout << "Metrics are disabled. Rebuild with -DCFG_METRICS to enable them." << endl;
+#endif
+}
+
+void Replay_Sessions();
+
+void Admin_fun()
+{
+    int opt;
+
+    sos:
+    cout << "1. Add CFGs" << endl;
+    cout << "2. View/Remove CFGs" << endl;
+    cout << "3. Dump Metrics" << endl;
+    cout << "4. Benchmark Built-in Grammars" << endl;
+    cout << "5. Rebuild Bank Index" << endl;
+    cout << "6. Replay Quiz Sessions" << endl;
+    cout << "7. Exit" << endl;
+    cout << "Choose : ";
+
+    cin >> opt;
+
+    switch (opt)
+    {
+    case 1:
+        Add_CFGs();
+        goto sos;
+        break;
+    case 2:
+        View_CFGs();
+        goto sos;
+        break;
+    case 3:
+        Dump_Metrics();
+        goto sos;
+        break;
+    case 4:
+        Benchmark_Engines();
+        goto sos;
+        break;
+    case 5:
+        Rebuild_Index();
+        goto sos;
+        break;
+    case 6:
+        Replay_Sessions();
+        goto sos;
+        break;
+    case 7:
+        return;
+        break;
+    default:
+        cout << "Try Again." << endl;
+        goto sos;
+        break;
+    }
+}
+
+// A fully built question. Construction (buildType1..buildType4) is kept apart from asking so a
+// grammar that turns out to be slow can be abandoned before the student sees anything.
+struct Question
+{
+    int type = 0;              // 1..4
+    int grammar = -1;          // index into the quiz's bank
+    string target;             // string to derive (types 3 and 4)
+    vector<string> options;    // shuffled choices (types 1 and 2)
+    string answer;             // correct choice (types 1 and 2)
+    vector<string> derivation; // expected steps (types 3 and 4)
+    string grammarText;        // the grammar as shown to the student
+    uint32_t seed = 0;         // quizRandom seed the question was built from
+};
+
+const long long QUESTION_DEADLINE_MS = 2000; // cap on time-to-question, across all fallbacks
+const long long ATTEMPT_DEADLINE_MS = 500;   // a single grammar/type attempt
+const long long ATTEMPT_STEP_BUDGET = 200000;
+
+int pickGrammar(const vector<CFG>& cfg_arr, const vector<bool>& skip)
+{
+    mt19937& rd = quizRandom();
+    vector<int> candidates;
+    for (int i = 0; i < (int)cfg_arr.size(); i++)
+    {
+        if (!skip[i]) candidates.push_back(i);
+    }
+    if (candidates.empty()) return rd() % cfg_arr.size();
+    return candidates[rd() % candidates.size()];
+}
+
+OpStatus buildType1(const vector<CFG>& cfg_arr, int it, Question& q, Budget& budget)
+{
+    int try_counter = 0;
+    q.type = 1;
+    q.grammar = it;
+    METRIC_SPAN("type1", H_TYPE1_US, it);
+
+    string options[4];
+    for(int i=0;i<3;i++)
+    {
+        OpResult<string> gen = cfg_arr[it].generateString(6, budget);
+        if (!gen.ok()) return gen.status;
+        options[i] = gen.value;
+    }
+
+    try_again:
+    if (!budget.step()) return budget.status;
+    int it2 = quizRandom()() % cfg_arr.size();
+    if(it2 == it)
+    {
+        try_counter++;
+        goto try_again;
+    }
+
+    OpResult<string> distractor = cfg_arr[it2].generateString(6, budget);
+    if (!distractor.ok()) return distractor.status;
+    options[3] = distractor.value;
+    OpResult<bool> valid = cfg_arr[it].isValidString(options[3], budget);
+    if (!valid.ok()) return valid.status;
+    if(valid.value)
+    {
+        try_counter++;
+        goto try_again;
+    }
+    METRIC_ADD(M_TYPE1_RETRIES, try_counter);
+    METRIC_OBSERVE(H_TYPE1_RETRIES, try_counter);
+    q.answer = options[3];
+
+    shuffle(options, options + 4, quizRandom());
+    q.options.assign(options, options + 4);
+    return OpStatus::Ok;
+}
+
+OpStatus buildType2(const vector<CFG>& cfg_arr, int it, Question& q, Budget& budget)
+{
+    int try_counter = 0;
+    q.type = 2;
+    q.grammar = it;
+    METRIC_SPAN("type2", H_TYPE2_US, it);
+
+    string options[4];
+    OpResult<string> gen = cfg_arr[it].generateString(6, budget);
+    if (!gen.ok()) return gen.status;
+    options[0] = gen.value;
+    q.answer = options[0];
+
+    for(int j=1;j<4;j++)
+    {
+        try_again:
+        if (!budget.step()) return budget.status;
+        int it2 = quizRandom()() % cfg_arr.size();
+        if(it2 == it)
+        {
+            try_counter++;
+            goto try_again;
+        }
+
+        OpResult<string> distractor = cfg_arr[it2].generateString(6, budget);
+        if (!distractor.ok()) return distractor.status;
+        options[j] = distractor.value;
+        OpResult<bool> valid = cfg_arr[it].isValidString(options[j], budget);
+        if (!valid.ok()) return valid.status;
+        if(valid.value) // try again if the give string is 'valid'. we want invalid strings
+        {
+            try_counter++;
+            goto try_again;
+        }
+    }
+    METRIC_ADD(M_TYPE2_RETRIES, try_counter);
+    METRIC_OBSERVE(H_TYPE2_RETRIES, try_counter);
+
+    shuffle(options, options + 4, quizRandom());
+    q.options.assign(options, options + 4);
+    return OpStatus::Ok;
+}
+
+// Types 3 and 4: derive a generated string with the left (type 3) or right (type 4) expansion method.
+OpStatus buildDerivation(const vector<CFG>& cfg_arr, int it, int type, Question& q, Budget& budget)
+{
+    q.type = type;
+    q.grammar = it;
+    METRIC_SPAN(type == 3 ? "type3" : "type4", type == 3 ? H_TYPE3_US : H_TYPE4_US, it);
+
+    OpResult<string> gen = cfg_arr[it].generateString(6, budget);
+    if (!gen.ok()) return gen.status;
+    q.target = gen.value;
+
+    OpResult<vector<string>> mod = type == 3 ? cfg_arr[it].deriveLeftmost(q.target, budget)
+                                             : cfg_arr[it].deriveRightmost(q.target, budget);
+    if (!mod.ok()) return mod.status;
+    q.derivation = mod.value;
+    return OpStatus::Ok;
+}
+
+void recordQuestionCost(const CFG& g, int type, chrono::steady_clock::time_point started, const Budget& budget, const Question& q, bool ok);
+
+// A question of the given type on grammar it, with all its randomness drawn from seed: the same
+// grammar, type and seed build the same question again (see Replay_Sessions).
+OpStatus buildQuestion(const vector<CFG>& cfg_arr, int it, int type, uint32_t seed, Question& q, Budget& budget)
+{
+    q = Question();
+    quizRandom().seed(seed);
+    OpStatus status;
+    switch(type)
+    {
+        case 1:
+            status = buildType1(cfg_arr, it, q, budget);
+            break;
+        case 2:
+            status = buildType2(cfg_arr, it, q, budget);
+            break;
+        default:
+            status = buildDerivation(cfg_arr, it, type, q, budget);
+            break;
+    }
+    q.seed = seed;
+    return status;
+}
+
+// Builds a question of the requested type within QUESTION_DEADLINE_MS, on grammar first if given.
+// When an attempt runs out of budget its grammar is skipped and the next question type is tried
+// instead. Every attempt's build time is recorded for the scheduler.
+bool prepareQuestion(const vector<CFG>& cfg_arr, int type, Question& q, const atomic<bool>* cancel = nullptr, int grammar = -1)
+{
+    auto questionDeadline = Budget::forMillis(QUESTION_DEADLINE_MS).deadline; // none in reproducible runs
+    vector<bool> skip(cfg_arr.size(), false);
+    for (int attempt = 0; attempt < 8; attempt++)
+    {
+        Budget budget = Budget::forMillis(ATTEMPT_DEADLINE_MS, ATTEMPT_STEP_BUDGET, cancel);
+        budget.deadline = min(budget.deadline, questionDeadline);
+        int it = attempt == 0 && grammar >= 0 ? grammar : pickGrammar(cfg_arr, skip);
+        auto started = chrono::steady_clock::now();
+        OpStatus status = buildQuestion(cfg_arr, it, type, quizRandom()(), q, budget);
+        if (status != OpStatus::Cancelled) recordQuestionCost(cfg_arr[it], type, started, budget, q, status == OpStatus::Ok);
+        if (status == OpStatus::Ok)
+        {
+            ostringstream text;
+            text << cfg_arr[q.grammar];
+            q.grammarText = text.str();
+            return true;
+        }
 
-        for (string& sym : symbols) result += sym;
-        return result;
+        METRIC_INC(M_QUESTION_FALLBACKS);
+        if (status == OpStatus::Cancelled || chrono::steady_clock::now() >= questionDeadline) return false;
+        skip[it] = true;
+        type = type % 4 + 1;
     }
+    return false;
+}
+// ---------------------------------------------------------------------------------------------
+// Adaptive scheduling. The cost model remembers, per grammar (by content hash) and question type,
+// how long questions took to build and how long their derivations were; it is shared by all
+// sessions. A QuizScheduler walks a difficulty curve that rises over the quiz and bends with the
+// student's streak, picks the (grammar, type) closest to it among those cheap enough to build now,
+// and builds the slow ones on a background thread while the student is answering.
+// ---------------------------------------------------------------------------------------------
+
+struct QuestionCost
+{
+    double buildMs = 0;         // moving averages over successful builds
+    double buildSteps = 0;      // budget steps; what the scheduler goes by, as it does not vary with load
+    double derivationSteps = 0; // types 3 and 4
+    int samples = 0;
+    int failures = 0;           // builds that ran out of budget
+};
+
+class CostModel
+{
+public:
+    struct Stats { long long attempts = 0, failed = 0, maxSteps = 0; };
 
-    bool isNonTerminal(const string& sym) 
+    void record(uint64_t grammar, int type, double ms, long long buildSteps, int derivationSteps, bool ok)
     {
-        return rules.find(sym) != rules.end();
+        lock_guard<mutex> lock(mtx);
+        update(byPair[{grammar, type}], ms, buildSteps, derivationSteps, ok);
+        update(byType[type], ms, buildSteps, derivationSteps, ok);
+        totals.attempts++;
+        totals.failed += !ok;
+        totals.maxSteps = max(totals.maxSteps, buildSteps);
     }
 
-    vector<string> tokenize(const string &alt) 
+    Stats stats()
     {
-        vector<string> toks;
-        for (char c: alt) toks.push_back(string(1, c));
-        return toks;
+        lock_guard<mutex> lock(mtx);
+        return totals;
     }
 
-    friend ostream& operator<<(ostream& os, const CFG& p);
-    friend void writeGrammarArrayToFile(const string& filename);
-    friend void readGrammarArrayFromFile(const string& filename);
+    // The (grammar, type) statistics, or the type's when that pair was never built.
+    QuestionCost estimate(uint64_t grammar, int type)
+    {
+        lock_guard<mutex> lock(mtx);
+        auto found = byPair.find({grammar, type});
+        if (found != byPair.end()) return found->second;
+        return byType[type];
+    }
+
+private:
+    mutex mtx;
+    map<pair<uint64_t, int>, QuestionCost> byPair;
+    map<int, QuestionCost> byType;
+    Stats totals;
+
+    static void update(QuestionCost& c, double ms, long long buildSteps, int derivationSteps, bool ok)
+    {
+        const double ALPHA = 0.3;
+        if (!ok)
+        {
+            c.failures++;
+            c.buildMs = max(c.buildMs, ms);
+            c.buildSteps = max(c.buildSteps, double(buildSteps));
+            return;
+        }
+        bool first = c.samples == 0;
+        c.buildMs = first ? ms : (1 - ALPHA) * c.buildMs + ALPHA * ms;
+        c.buildSteps = first ? buildSteps : (1 - ALPHA) * c.buildSteps + ALPHA * buildSteps;
+        c.derivationSteps = first ? derivationSteps : (1 - ALPHA) * c.derivationSteps + ALPHA * derivationSteps;
+        c.samples++;
+    }
 };
 
-ostream& operator<<(ostream& os, const CFG& p) 
+CostModel sharedCostModel;
+thread_local CostModel* threadCostModel = nullptr; // the load test gives each worker its own
+
+CostModel& costModel()
 {
-    for(const auto& [symbol, prod_rule] : p.rules)
+    return threadCostModel ? *threadCostModel : sharedCostModel;
+}
+
+void recordQuestionCost(const CFG& g, int type, chrono::steady_clock::time_point started, const Budget& budget, const Question& q, bool ok)
+{
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    costModel().record(g.contentHash(), type, ms, budget.steps, q.derivation.size(), ok);
+}
+
+const double FOREGROUND_BUILD_STEPS = 20000; // expected builds costlier than this go to the background
+const double READY_TOLERANCE = 0.75;    // how far off the target a prepared question may be
+const size_t MAX_READY = 2;
+
+// Where a quiz stands: questions asked (skipped ones included) and the answers given so far,
+// scored by streak.
+struct QuizProgress
+{
+    int asked = 0, streak = 0, points = 0;
+    vector<bool> outcomes;
+
+    void skipped() { asked++; }
+
+    void answered(bool right)
     {
-        if(symbol == "S'")
+        asked++;
+        outcomes.push_back(right);
+        streak = right ? streak + 1 : 0;
+        points += right ? streak : 0;
+    }
+};
+
+class QuizScheduler
+{
+public:
+    QuizScheduler(BankRef bank, int questions) : bank(bank), questions(questions), costs(costModel()), rng(quizRandom()()) {}
+
+    ~QuizScheduler()
+    {
+        cancelPending = true;
+        if (pending.valid()) pending.wait();
+    }
+
+    // Target difficulty: 1 to 3 across the quiz, up to +0.9 on a streak, -0.5 after a miss,
+    // and +-0.25 for overall accuracy.
+    double target() const
+    {
+        return targetAfter(answers, correct, streak, lastCorrect);
+    }
+
+    bool next(Question& q)
+    {
+        harvest(reproducibleRuns);
+        double goal = target();
+        asked++;
+
+        // A question prepared in the background, if one is close enough.
+        int best = -1;
+        for (int i = 0; i < (int)ready.size(); i++)
         {
-            continue;
+            if (best < 0 || fabs(ready[i].second - goal) < fabs(ready[best].second - goal)) best = i;
         }
-        cout << "Non-Terminal : " << symbol << endl;
-        for(int i=0;i<prod_rule.rhs.size(); i++)
+        if (best >= 0 && fabs(ready[best].second - goal) <= READY_TOLERANCE)
         {
-            // string str = "";
-            // for(int j=0;j<prod_rule.rhs[i].size();j++)
-            // {
-            //     str += prod_rule.rhs[i][j];
-            // }
-            cout << "Rule: " << prod_rule.rhs[i] << endl;
+            q = ready[best].first;
+            ready.erase(ready.begin() + best);
+            prefetch();
+            return true;
+        }
+
+        Candidate c = choose(goal, true);
+        bool built;
+        if (c.grammar < 0 && pending.valid())
+        {
+            // Only slow candidates remain; the one already under way is the best bet.
+            pending.wait_for(chrono::milliseconds(QUESTION_DEADLINE_MS));
+            harvest(false);
+            if (ready.empty()) return false;
+            q = ready.front().first;
+            ready.erase(ready.begin());
+            built = true;
+        }
+        else
+        {
+            if (c.grammar < 0) c = choose(goal, false);
+            built = c.grammar >= 0 && prepareQuestion(bank->grammars, c.type, q, nullptr, c.grammar);
         }
+        prefetch();
+        return built;
     }
-    return os;
-}
 
-vector<CFG> cfg_arr;
-set<int, greater<int>> leaderboard[3]; // 0=easy, 1=m, 2=h
+    // Picks up a quiz that was interrupted after progress.
+    void resume(const QuizProgress& progress)
+    {
+        asked = progress.asked;
+        for (bool wasCorrect : progress.outcomes) answered(wasCorrect);
+    }
 
-void writeGrammarArrayToFile(const string& filename) 
-{
-    ofstream outFile(filename);
+    void answered(bool wasCorrect)
+    {
+        answers++;
+        correct += wasCorrect;
+        lastCorrect = wasCorrect;
+        streak = wasCorrect ? streak + 1 : 0;
+    }
 
-    for (const auto& grammar : cfg_arr) {
-        outFile << "START " << grammar.startSymbol << "\n";
-        outFile << "RULES " << grammar.rules.size() << "\n";
-        for (const auto& [key, prod] : grammar.rules) 
+private:
+    struct Candidate { int grammar = -1, type = 0; double difficulty = 0, cost = 0; };
+
+    BankRef bank;
+    int questions, asked = 0, answers = 0, correct = 0, streak = 0;
+    CostModel& costs;
+    bool lastCorrect = false;
+    int lastGrammar = -1;
+    mt19937 rng;
+
+    future<pair<bool, Question>> pending;
+    atomic<bool> cancelPending{false};
+    vector<pair<Question, double>> ready;
+
+    double targetAfter(int answers, int correct, int streak, bool lastCorrect) const
+    {
+        double curve = 1.0 + 2.0 * asked / max(1, questions - 1);
+        double form = answers == 0 ? 0 : lastCorrect ? 0.3 * min(streak, 3) : -0.5;
+        double accuracy = answers == 0 ? 0 : 0.5 * (double(correct) / answers - 0.5);
+        return min(4.0, max(1.0, curve + form + accuracy));
+    }
+
+    // Types 3 and 4 ask for a whole derivation, so they weigh in more, and more so the longer
+    // the derivation usually is. Larger grammars take longer to read.
+    double difficulty(int grammar, int type, const QuestionCost& cost) const
+    {
+        static const double TYPE_WEIGHT[5] = {0, 1.0, 1.0, 2.0, 2.5};
+        int ruleCount = bank->grammars[grammar].getRules().size() - 1;
+        double steps = cost.samples > 0 ? cost.derivationSteps : 8;
+        return TYPE_WEIGHT[type] + 0.1 * ruleCount + (type >= 3 ? 0.1 * steps : 0);
+    }
+
+    // Closest (grammar, type) to goal, with a little jitter for variety. Pairs that keep running
+    // out of budget are left out; with cheapOnly, so are the ones expected to be slow.
+    Candidate choose(double goal, bool cheapOnly)
+    {
+        Candidate best;
+        double bestScore = 1e18;
+        uniform_real_distribution<double> jitter(0, 0.3);
+        for (int g = 0; g < (int)bank->grammars.size(); g++)
         {
-            outFile << key << " -> " << prod.lhs;
-            for (const auto& sym : prod.rhs) 
+            for (int type = 1; type <= 4; type++)
             {
-                if(sym == "")
+                QuestionCost cost = costs.estimate(bank->grammars[g].contentHash(), type);
+                if (cost.failures >= 2 && cost.failures > cost.samples) continue;
+                if (cheapOnly && cost.buildSteps > FOREGROUND_BUILD_STEPS) continue;
+                double d = difficulty(g, type, cost);
+                double score = fabs(d - goal) + jitter(rng) + (g == lastGrammar ? 0.5 : 0);
+                if (score < bestScore)
                 {
-                    outFile << " empty";
+                    bestScore = score;
+                    best = {g, type, d, cost.buildSteps};
                 }
-                else
-                {
-                    outFile << " " << sym;
-                }   
             }
-            outFile << "\n";
         }
-        outFile << "END\n";
+        if (best.grammar >= 0) lastGrammar = best.grammar;
+        return best;
     }
 
-    outFile.close();
-}
-
-void readGrammarArrayFromFile(const string& filename) 
-{
-    cfg_arr.clear();
+    // Moves a finished background build to ready; with wait, blocks until it finishes. The
+    // difficulty is that of the question built, since prepareQuestion may have fallen back to
+    // another grammar or type than the one asked for.
+    void harvest(bool wait)
+    {
+        if (!pending.valid()) return;
+        if (!wait && pending.wait_for(chrono::seconds(0)) != future_status::ready) return;
+        pair<bool, Question> done = pending.get();
+        const Question& q = done.second;
+        if (!done.first || q.grammar < 0 || q.grammar >= (int)bank->grammars.size()) return;
+        QuestionCost cost = costs.estimate(bank->grammars[q.grammar].contentHash(), q.type);
+        ready.push_back({q, difficulty(q.grammar, q.type, cost)});
+    }
 
-    ifstream inFile(filename);
-    string line;
+    // Starts the slow question best suited to the next target, assuming this one is answered
+    // correctly, unless something is already being prepared. Prepared questions nobody picked
+    // are dropped oldest first.
+    void prefetch()
+    {
+        if (ready.size() > MAX_READY) ready.erase(ready.begin());
+        if (pending.valid() || asked >= questions) return;
+        double goal = targetAfter(answers + 1, correct + 1, streak + 1, true);
 
-    while (getline(inFile, line)) {
-        if (line.substr(0, 6) == "START ") {
-            CFG g("S");
-            g.startSymbol = line.substr(6);
-
-            getline(inFile, line); // RULES n
-            int ruleCount = stoi(line.substr(6));
-
-            for (int i = 0; i < ruleCount; ++i) {
-                getline(inFile, line);
-                size_t arrowPos = line.find("->");
-                string key = line.substr(0, arrowPos - 1);
-                string rest = line.substr(arrowPos + 3);
-
-                istringstream ss(rest);
-                Production p;
-                ss >> p.lhs;
-
-                string sym;
-                while (ss >> sym) {
-                    if (sym == "empty") {
-                        p.rhs.push_back(""); // Interpret "empty" as ""
-                    } else {
-                        p.rhs.push_back(sym);
-                    }
+        Candidate best;
+        double bestScore = 1e18;
+        for (int g = 0; g < (int)bank->grammars.size(); g++)
+        {
+            for (int type = 1; type <= 4; type++)
+            {
+                QuestionCost cost = costs.estimate(bank->grammars[g].contentHash(), type);
+                if (cost.buildSteps <= FOREGROUND_BUILD_STEPS || (cost.failures >= 2 && cost.failures > cost.samples)) continue;
+                double d = difficulty(g, type, cost);
+                if (fabs(d - goal) < bestScore)
+                {
+                    bestScore = fabs(d - goal);
+                    best = {g, type, d, cost.buildSteps};
                 }
-
-                g.rules[key] = p;
             }
-
-            getline(inFile, line); // END
-            cfg_arr.push_back(g);
         }
+        if (best.grammar < 0) return;
+
+        BankRef snapshot = bank;
+        const atomic<bool>* cancel = &cancelPending;
+        CostModel* model = &costs;
+        uint32_t seed = rng();
+        // Reproducible runs defer the build to the next harvest, on the session's own thread.
+        pending = async(reproducibleRuns ? launch::deferred : launch::async, [snapshot, best, cancel, model, seed]
+        {
+            mt19937 savedRandom = quizRandom();
+            CostModel* savedModel = threadCostModel;
+            quizRandom().seed(seed);
+            threadCostModel = model;
+            Question q;
+            bool ok = prepareQuestion(snapshot->grammars, best.type, q, cancel, best.grammar);
+            quizRandom() = savedRandom;
+            threadCostModel = savedModel;
+            return make_pair(ok, q);
+        });
     }
+};
 
-    inFile.close();
-    return;
-}
 
-void writeScoreFromFile()
+// Types 1 and 2 over sym_arr. Distractors are generated sentences with one token deleted,
+// duplicated, swapped or inserted, kept only when the parser rejects them.
+OpStatus buildSymbolicQuestion(int type, Question& q, Budget& budget)
 {
-    ofstream outFile("Scoreboard.txt");
+    mt19937 rng(quizRandom()());
+    int it = rng() % sym_arr.size();
+    SymbolGrammar& g = sym_arr[it];
+    q.type = type;
+    q.grammar = it;
+    ostringstream text;
+    text << g;
+    q.grammarText = text.str();
 
-    for(int i=0; i<3;i++)
+    vector<int> terms = g.terminals();
+    auto invalidSentence = [&](string& out)
     {
-       // outFile << "START\n";
-        for(int item : leaderboard[i])
+        while (budget.step())
         {
-            outFile << item << " ";
+            vector<int> toks = g.generateTokens(5, rng);
+            int pos = toks.empty() ? 0 : rng() % toks.size();
+            switch (rng() % 4)
+            {
+                case 0:
+                    if (!toks.empty()) toks.erase(toks.begin() + pos);
+                    break;
+                case 1:
+                    if (!toks.empty()) toks.insert(toks.begin() + pos, toks[pos]);
+                    break;
+                case 2:
+                    if (toks.size() > 1) swap(toks[pos], toks[(pos + 1) % toks.size()]);
+                    break;
+                default:
+                    toks.insert(toks.begin() + pos, terms[rng() % terms.size()]);
+                    break;
+            }
+            OpResult<bool> valid = g.isValidTokens(toks, budget);
+            if (!valid.ok()) return valid.status;
+            if (!valid.value && g.spell(toks, rng, out)) return OpStatus::Ok;
+        }
+        return budget.status;
+    };
+
+    string options[4];
+    for (int i = 0; i < 4; i++)
+    {
+        if ((type == 1) == (i == 0))
+        {
+            OpStatus status = invalidSentence(options[i]);
+            if (status != OpStatus::Ok) return status;
+        }
+        else
+        {
+            while (!g.generateString(5, rng, options[i]))
+            {
+                if (!budget.step()) return budget.status;
+            }
         }
-        outFile << "\n";
-       // outFile << "END\n";
     }
-    outFile.close();
-    return;
+    q.answer = options[0];
+    shuffle(options, options + 4, rng);
+    q.options.assign(options, options + 4);
+    return OpStatus::Ok;
 }
 
-void readScoreFromFile()
+bool prepareSymbolicQuestion(int type, Question& q)
 {
-    ifstream inFile("Scoreboard.txt");
-    string line;
-    int i = 0;
+    Budget budget = Budget::forMillis(QUESTION_DEADLINE_MS, ATTEMPT_STEP_BUDGET);
+    uint32_t seed = quizRandom()();
+    quizRandom().seed(seed);
+    if (sym_arr.empty() || buildSymbolicQuestion(type, q, budget) != OpStatus::Ok) return false;
+    q.seed = seed;
+    return true;
+}
 
-    while(getline(inFile, line) && i < 3)
+// Poses q on out and reads the reply from in; reply, if given, receives what was chosen or typed.
+bool askQuestion(const Question& q, istream& in = cin, ostream& out = cout, string* reply = nullptr)
+{
+    if (q.type == 1 || q.type == 2)
     {
-        istringstream ss(line);
-        int item;
-        while(ss >> item)
+        out << (q.type == 1 ? "Select the invalid string from the followiing CFG :\n" : "Select the valid string from the followiing CFG :\n");
+        out << q.grammarText << endl;
+        out << q.answer << " ANS here " << endl;
+
+        for(int i=0;i<(int)q.options.size();i++)
         {
-            leaderboard[i].insert(item);
+            out << i+1 << ". " << q.options[i] << endl;
+        }
+        int opt = 0;
+        out << "Choose: " ;
+        in >> opt; 
+        if (reply) *reply = opt >= 1 && opt <= (int)q.options.size() ? q.options[opt-1] : to_string(opt);
+
+        if(opt >= 1 && opt <= (int)q.options.size() && q.options[opt-1] == q.answer)
+        {
+            out << "Correct Answer!!! " << endl;
+            return true;
+        }
+        else
+        {
+            out << "Better Luck Next Time!!!" << endl;
+            return false;
         }
-        i++;
     }
 
-    inFile.close();
+    out << "Derive the following string \'" << q.target << "\' using the given CFG\n Use "
+         << (q.type == 3 ? "left" : "Right") << " Expansion method" << endl;
+    out << q.grammarText << endl;
+
+    vector<string> ans;
+    string opt;
+    out << "Enter 'done' when final answer reached" << endl;
+    while(in >> opt)
+    {
+        if(opt == "done")
+        {
+            break;
+        }
+        ans.push_back(opt);
+    }
+    if (reply)
+    {
+        reply->clear();
+        for (const string& step : ans) *reply += (reply->empty() ? "" : " ") + step;
+    }
+    
+    if(ans == q.derivation)
+    {
+        out << "Correct Answer!!" << endl;
+        return true;
+    }
+    else
+    {
+        out << "Better Luck Next Time!" << endl;
+        return false;
+    }
 }
 
-void Add_CFGs()
+// ---------------------------------------------------------------------------------------------
+// Session log (sessions.wal). Every quiz appends binary records as it goes: a start record with
+// the difficulty, one record per question (the seed it was built from, the grammar, the correct
+// answer, the student's reply and how long both took), and an end record with the score. A
+// record is fsynced before the next question is shown, so an interrupted quiz can be resumed
+// where it stopped and any finished one replayed. Appends from all sessions go through one
+// flusher thread: whatever arrives while an fsync is in flight is written and synced together
+// with the next one (group commit). A batch is never held back to wait for more: the fsync in
+// flight is what gathers the next batch, so a lone quiz pays one sync per record and busy ones
+// share syncs without extra latency.
+//
+// File: "CFGWAL1\n", then records of [u32 payload length][u32 checksum][payload], little-endian.
+// The checksum is the low half of fnv1a(payload). A torn last record is cut off on open.
+// Payloads start with a kind byte and the session id (varint):
+//   START    rank (byte), tags (string), bank seed (u32), unix time (varint)
+//   QUESTION type (byte), grammar fnv1a (u64), seed (u32), answer (string), reply (string),
+//            correct (byte), build ms (varint), answer ms (varint)
+//   SKIP     (nothing else)
+//   END      points (varint), abandoned (byte)
+// Strings are a varint length followed by the bytes.
+// ---------------------------------------------------------------------------------------------
+
+const char* const SESSION_LOG_FILE = "sessions.wal";
+const char SESSION_LOG_MAGIC[] = "CFGWAL1\n";
+
+enum SessionRecordKind { REC_START = 1, REC_QUESTION = 2, REC_SKIP = 3, REC_END = 4 };
+
+void putVarint(string& out, uint64_t v)
 {
-    string difficulty;
-    cout << "Select New CFG difficuly(easy,medium,hard) : ";
-    cin >> difficulty;
-    if(difficulty == "easy")
+    while (v >= 0x80)
     {
-        difficulty = "easy_cfgs.txt";
-        readGrammarArrayFromFile("easy_cfgs.txt");
+        out += char(v | 0x80);
+        v >>= 7;
     }
-    else if(difficulty == "medium")
+    out += char(v);
+}
+
+void putFixed(string& out, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++) out += char(v >> (8 * i));
+}
+
+void putBytes(string& out, const string& s)
+{
+    putVarint(out, s.size());
+    out += s;
+}
+
+struct RecordReader
+{
+    const string& data;
+    size_t pos = 0, end = 0;
+
+    bool varint(uint64_t& v)
     {
-        difficulty = "medium_cfgs.txt";
-        readGrammarArrayFromFile("medium_cfgs.txt");
+        v = 0;
+        for (int shift = 0; shift < 64 && pos < end; shift += 7)
+        {
+            unsigned char c = data[pos++];
+            v |= uint64_t(c & 0x7f) << shift;
+            if (!(c & 0x80)) return true;
+        }
+        return false;
     }
-    else if(difficulty == "hard")
+
+    bool fixed(uint64_t& v, int bytes)
     {
-        difficulty = "hard_cfgs.txt";
-        readGrammarArrayFromFile("hard_cfgs.txt");
+        if (end - pos < (size_t)bytes) return false;
+        v = 0;
+        for (int i = 0; i < bytes; i++) v |= uint64_t((unsigned char)data[pos++]) << (8 * i);
+        return true;
     }
-    else
+
+    bool bytes(string& s)
     {
-        cout <<"Invalid Difficulty Option." << endl;
-        return;
+        uint64_t n;
+        if (!varint(n) || end - pos < n) return false;
+        s = data.substr(pos, n);
+        pos += n;
+        return true;
     }
+};
 
-    string init;
-    int counter = 0;
-    vector<string> prod_rule;
-    CFG cfg("S");
+struct LoggedQuestion
+{
+    int type = 0;             // 0 when the question was skipped
+    uint64_t grammar = 0;     // fnv1a of the grammar text
+    uint32_t seed = 0;
+    string answer;            // the correct option, or the string to derive
+    string reply;             // what the student chose or typed
+    bool correct = false;
+    uint32_t buildMs = 0, answerMs = 0;
+};
 
-    cout << "Add Rules: " << endl;
-    while(1)
+struct LoggedSession
+{
+    uint64_t id = 0;
+    int rank = 0;
+    string tags;
+    uint32_t bankSeed = 0;    // draws the working set from the bank index (loadQuizBank)
+    time_t started = 0;
+    vector<LoggedQuestion> questions;
+    bool ended = false, abandoned = false;
+    int points = 0;
+
+    QuizProgress progress() const
     {
-        prod_rule.clear();
-        cout << "Enter Non-Terminal : ";
-        cin >> init;
-        if(init == "stop")
+        QuizProgress p;
+        for (const LoggedQuestion& lq : questions)
         {
-            break;
+            if (lq.type == 0) p.skipped();
+            else p.answered(lq.correct);
         }
-        while(1)
+        return p;
+    }
+};
+
+bool syncFile(FILE* f)
+{
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+// Cuts filename to length bytes where it lies and syncs it; nothing else is rewritten.
+bool truncateFile(const string& filename, uint64_t length)
+{
+    FILE* f = fopen(filename.c_str(), "r+b");
+    if (!f) return false;
+#ifdef _WIN32
+    bool ok = _chsize_s(_fileno(f), length) == 0;
+#else
+    bool ok = ftruncate(fileno(f), length) == 0;
+#endif
+    ok = ok && syncFile(f);
+    return fclose(f) == 0 && ok;
+}
+
+class SessionLog
+{
+public:
+    struct Stats { uint64_t records = 0, bytes = 0, syncs = 0; };
+
+    ~SessionLog() { close(); }
+
+    bool isOpen() const { return file != nullptr; }
+
+    // Reads every session in filename. validBytes is set to the length of the intact prefix.
+    static bool read(const string& filename, vector<LoggedSession>& sessions, uint64_t* validBytes = nullptr)
+    {
+        ifstream in(filename, ios::binary);
+        if (!in) return false;
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        size_t magic = sizeof(SESSION_LOG_MAGIC) - 1;
+        if (data.compare(0, magic, SESSION_LOG_MAGIC) != 0) return false;
+
+        unordered_map<uint64_t, size_t> where;
+        size_t pos = magic;
+        while (data.size() - pos >= 8)
         {
-            string str;
-            cout << "Product rule counter(empty for \"\") " << counter +1 << " : ";
-            cin >> str;
-            if(str == "next")
+            RecordReader header{data, pos, pos + 8};
+            uint64_t length, checksum;
+            header.fixed(length, 4);
+            header.fixed(checksum, 4);
+            if (data.size() - pos - 8 < length || uint32_t(fnv1a(data.substr(pos + 8, length))) != checksum) break;
+            RecordReader r{data, pos + 8, pos + 8 + length};
+            pos += 8 + length;
+
+            uint64_t kind, id, v;
+            if (!r.fixed(kind, 1) || !r.varint(id)) continue;
+            if (kind == REC_START)
             {
-                cfg.addRule(init, prod_rule);
-                break;
+                LoggedSession s;
+                s.id = id;
+                if (!r.fixed(v, 1)) continue;
+                s.rank = v;
+                if (!r.bytes(s.tags) || !r.fixed(v, 4)) continue;
+                s.bankSeed = v;
+                if (!r.varint(v)) continue;
+                s.started = v;
+                where[id] = sessions.size();
+                sessions.push_back(s);
+                continue;
+            }
+            auto found = where.find(id);
+            if (found == where.end()) continue;
+            LoggedSession& s = sessions[found->second];
+            LoggedQuestion lq;
+            if (kind == REC_QUESTION)
+            {
+                uint64_t type, grammar, seed, correct, buildMs, answerMs;
+                if (!r.fixed(type, 1) || !r.fixed(grammar, 8) || !r.fixed(seed, 4) || !r.bytes(lq.answer) || !r.bytes(lq.reply)
+                    || !r.fixed(correct, 1) || !r.varint(buildMs) || !r.varint(answerMs)) continue;
+                lq.type = type;
+                lq.grammar = grammar;
+                lq.seed = seed;
+                lq.correct = correct;
+                lq.buildMs = buildMs;
+                lq.answerMs = answerMs;
+                s.questions.push_back(lq);
+            }
+            else if (kind == REC_SKIP)
+            {
+                s.questions.push_back(lq);
             }
-            if(str == "empty")
+            else if (kind == REC_END && r.varint(v))
             {
-                str = "";
+                s.points = v;
+                s.ended = true;
+                s.abandoned = r.fixed(v, 1) && v;
             }
-            prod_rule.push_back(str);
-            counter++;
         }
+        if (validBytes) *validBytes = pos;
+        return true;
     }
 
-    cfg_arr.push_back(cfg);
+    // Opens filename for appending, creating it if needed, and hands back the sessions already
+    // in it. A torn record at the end, left by a crash mid-write, is cut off first, in place: the
+    // synced records before it are never copied, so a crash during recovery cannot lose them.
+    bool open(const string& filename, vector<LoggedSession>& recovered)
+    {
+        if (file) return true;
+        uint64_t valid = 0;
+        if (!read(filename, recovered, &valid))
+        {
+            ifstream existing(filename, ios::binary);
+            if (existing && existing.peek() != EOF) return false; // not a session log; leave it alone
+            ofstream(filename, ios::binary) << SESSION_LOG_MAGIC;
+        }
+        else
+        {
+            ifstream in(filename, ios::binary | ios::ate);
+            if ((uint64_t)in.tellg() > valid && !truncateFile(filename, valid)) return false;
+        }
+        for (const LoggedSession& s : recovered) nextId = max(nextId, s.id + 1);
 
-    writeGrammarArrayToFile(difficulty);
-   
-    return;
-}
+        file = fopen(filename.c_str(), "ab");
+        if (!file) return false;
+        stopping = false;
+        failed = false;
+        flusher = thread(&SessionLog::flushLoop, this);
+        return true;
+    }
 
-void View_CFGs()
-{
-    string difficulty;
-    cout << "Select CFG difficuly to view(easy,medium,hard) : ";
-    cin >> difficulty;
-    if(difficulty == "easy")
+    void close()
     {
-        difficulty = "easy_cfgs.txt";
+        if (!file) return;
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        flusher.join();
+        fclose(file);
+        file = nullptr;
     }
-    else if(difficulty == "medium")
+
+    bool begin(LoggedSession& s, int rank, const string& tags, uint32_t bankSeed)
     {
-        difficulty = "medium_cfgs.txt";
+        {
+            lock_guard<mutex> lock(m);
+            s = LoggedSession();
+            s.id = nextId++;
+        }
+        s.rank = rank;
+        s.tags = tags;
+        s.bankSeed = bankSeed;
+        s.started = time(0);
+        string payload = header(REC_START, s.id);
+        putFixed(payload, rank, 1);
+        putBytes(payload, tags);
+        putFixed(payload, bankSeed, 4);
+        putVarint(payload, s.started);
+        return commit(payload);
     }
-    else if(difficulty == "hard")
+
+    bool record(LoggedSession& s, const LoggedQuestion& lq)
     {
-        difficulty = "hard_cfgs.txt";
+        s.questions.push_back(lq);
+        string payload = header(lq.type == 0 ? REC_SKIP : REC_QUESTION, s.id);
+        if (lq.type != 0)
+        {
+            putFixed(payload, lq.type, 1);
+            putFixed(payload, lq.grammar, 8);
+            putFixed(payload, lq.seed, 4);
+            putBytes(payload, lq.answer);
+            putBytes(payload, lq.reply);
+            putFixed(payload, lq.correct, 1);
+            putVarint(payload, lq.buildMs);
+            putVarint(payload, lq.answerMs);
+        }
+        return commit(payload);
     }
-    else
+
+    bool end(LoggedSession& s, int points, bool abandoned = false)
     {
-        cout <<"Invalid Difficulty Option." << endl;
-        return;
+        s.ended = true;
+        s.points = points;
+        s.abandoned = abandoned;
+        string payload = header(REC_END, s.id);
+        putVarint(payload, points);
+        putFixed(payload, abandoned, 1);
+        return commit(payload);
     }
-    readGrammarArrayFromFile(difficulty);
-    cout << endl;
-    for(int i=0;i<cfg_arr.size();i++)
+
+    Stats stats()
     {
-        cout << i+1 << ". " << cfg_arr[i] << endl;
+        lock_guard<mutex> lock(m);
+        return counts;
     }
 
-    int opt;
-    cout << "Enter Index of CFG to delete(0 to exit) : ";
-    cin >> opt;
+private:
+    FILE* file = nullptr;
+    thread flusher;
+    mutex m;
+    condition_variable wake, synced;
+    string pending;                      // framed records not yet written
+    uint64_t appended = 0, durable = 0;  // bytes handed to commit() / written and synced
+    uint64_t nextId = 1;
+    bool stopping = false, failed = false;
+    Stats counts;
 
-    if(opt == 0)
+    static string header(SessionRecordKind kind, uint64_t id)
     {
-        return;
+        string payload(1, char(kind));
+        putVarint(payload, id);
+        return payload;
     }
-    else if(opt <= cfg_arr.size())
+
+    // Appends one record and returns once it is on disk.
+    bool commit(const string& payload)
     {
-        cfg_arr.erase(cfg_arr.begin() + opt-1);
-        writeGrammarArrayToFile(difficulty);
+        string frame;
+        putFixed(frame, payload.size(), 4);
+        putFixed(frame, uint32_t(fnv1a(payload)), 4);
+        frame += payload;
+        unique_lock<mutex> lock(m);
+        pending += frame;
+        appended += frame.size();
+        uint64_t upTo = appended;
+        counts.records++;
+        wake.notify_one();
+        synced.wait(lock, [&] { return durable >= upTo || failed; });
+        return !failed;
     }
-    else
+
+    void flushLoop()
     {
-        cout << "Invalid Option. " << endl;
-        return;
+        unique_lock<mutex> lock(m);
+        while (true)
+        {
+            wake.wait(lock, [&] { return !pending.empty() || stopping; });
+            if (pending.empty()) return;
+            string batch;
+            batch.swap(pending);
+            uint64_t upTo = appended;
+            lock.unlock();
+            bool ok = fwrite(batch.data(), 1, batch.size(), file) == batch.size() && fflush(file) == 0 && syncFile(file);
+            lock.lock();
+            counts.bytes += batch.size();
+            counts.syncs++;
+            if (ok) durable = upTo;
+            else failed = true;
+            synced.notify_all();
+        }
     }
-    
-}
-
-void Admin_fun()
-{
-    int opt;
+};
 
-    sos:
-    cout << "1. Add CFGs" << endl;
-    cout << "2. View/Remove CFGs" << endl;
-    cout << "3. Exit" << endl;
-    cout << "Choose : ";
+SessionLog sessionLog;
 
-    cin >> opt;
+const int QUIZ_QUESTIONS = 10;
 
-    switch (opt)
+// One quiz: QUIZ_QUESTIONS questions from bank (sym_arr when symbolic), scored by streak. ask
+// poses a question, fills in the reply and says whether it was right; built hears how long each
+// question took to prepare, with null for one that could not be. With a log, every question is
+// recorded in session, and a session that already has questions is carried on from there.
+int runQuizSession(BankRef bank, bool symbolic, const function<bool(const Question&, string&)>& ask, ostream& out = cout,
+                   const function<void(const Question*, double)>& built = nullptr, SessionLog* log = nullptr,
+                   LoggedSession* session = nullptr)
+{
+    bool ret;
+    QuizProgress progress = session ? session->progress() : QuizProgress();
+    unique_ptr<QuizScheduler> scheduler;
+    if (!symbolic)
     {
-    case 1:
-        Add_CFGs();
-        goto sos;
-        break;
-    case 2:
-        View_CFGs();
-        goto sos;
-        break;
-    case 3:
-        return;
-        break;
-    default:
-        cout << "Try Again." << endl;
-        goto sos;
-        break;
+        scheduler.reset(new QuizScheduler(bank, QUIZ_QUESTIONS));
+        scheduler->resume(progress);
+    }
+    auto record = [&](const LoggedQuestion& lq)
+    {
+        if (log && session && !log->record(*session, lq))
+        {
+            out << "Could not write " << SESSION_LOG_FILE << "; the rest of this quiz is not saved." << endl;
+            log = nullptr;
+        }
+    };
+    while(progress.asked < QUIZ_QUESTIONS)
+    {
+        // 1: guess invalid string, 2: guess valid string, 3/4: left/right derivation
+        Question q;
+        auto started = chrono::steady_clock::now();
+        bool ready = symbolic ? prepareSymbolicQuestion(quizRandom()() % 2 + 1, q) : scheduler->next(q);
+        double buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        if (built) built(ready ? &q : nullptr, buildMs);
+        if (!ready)
+        {
+            out << "Could not prepare a question in time, skipping it." << endl << endl;
+            progress.skipped();
+            record(LoggedQuestion());
+            continue;
+        }
+        string reply;
+        started = chrono::steady_clock::now();
+        ret = ask(q, reply);
+        out << endl;
+        if (scheduler) scheduler->answered(ret);
+        progress.answered(ret);
+
+        LoggedQuestion lq;
+        lq.type = q.type;
+        lq.grammar = fnv1a(q.grammarText);
+        lq.seed = q.seed;
+        lq.answer = q.type <= 2 ? q.answer : q.target;
+        lq.reply = reply;
+        lq.correct = ret;
+        lq.buildMs = buildMs;
+        lq.answerMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        record(lq);
     }
+    if (log && session) log->end(*session, progress.points);
+    return progress.points;
 }
 
-bool type1()
+const char* const DIFFICULTY_NAMES[4] = { "easy", "medium", "hard", "expr" };
+
+// Offers to resume the latest quiz the log says was never finished. Any other unfinished ones
+// are closed as abandoned; so is the latest if the student declines.
+bool offerResume(vector<LoggedSession>& recovered, LoggedSession& session)
 {
-    int try_counter = 0;
-    srand(time(NULL));
-    int it = rand()%cfg_arr.size();
-    
-    cout << "Select the invalid string from the followiing CFG :\n" << cfg_arr[it] << endl;
-    string options[4];
-    for(int i=0;i<3;i++)
+    LoggedSession* latest = nullptr;
+    for (LoggedSession& s : recovered)
     {
-        options[i] = cfg_arr[it].generateString(6);
+        if (!s.ended && s.rank >= 0 && s.rank <= 3 && (!latest || s.id > latest->id)) latest = &s;
     }
+    if (!latest) return false;
 
-    try_again:
-    std::random_device rd;
-    int it2 = rd() % cfg_arr.size();
-    //int it2 = rand()%cfg_arr.size();
-    if(it2 == it)
+    QuizProgress progress = latest->progress();
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&latest->started));
+    cout << "An unfinished " << DIFFICULTY_NAMES[latest->rank] << (latest->tags.empty() ? "" : "," + latest->tags)
+         << " quiz from " << when << " was found (" << progress.asked << " of " << QUIZ_QUESTIONS
+         << " questions, " << progress.points << " points). Resume it? (y/n) : ";
+    string answer;
+    cin >> answer;
+    bool resume = answer == "y" || answer == "Y";
+    for (LoggedSession& s : recovered)
     {
-        //cout << "we are trying again " << endl;
-        try_counter++;
-        goto try_again;
+        if (!s.ended && (!resume || &s != latest)) sessionLog.end(s, s.progress().points, true);
     }
+    if (resume) session = *latest;
+    return resume;
+}
 
-    options[3] = cfg_arr[it2].generateString(6);
-    if(cfg_arr[it].isValidString(options[3]))
+void Quiz()
+{
+    string difficulty;
+    int difficulty_rank;
+    string tags;
+    BankRef bank; // this quiz's snapshot; admin edits published meanwhile do not affect it
+    vector<LoggedSession> recovered;
+    LoggedSession session;
+    bool logging = sessionLog.open(SESSION_LOG_FILE, recovered);
+    bool resumed = logging && offerResume(recovered, session);
+    if (!logging)
     {
-        //cout << "we are trying again " << endl;
-        try_counter++;
-        goto try_again;
+        cout << "Could not open " << SESSION_LOG_FILE << "; this quiz cannot be resumed if interrupted." << endl;
     }
-    cout << options[3] << " ANS here " << endl;
-    string ans = options[3];
-
-    unsigned seed = chrono::system_clock::now().time_since_epoch().count();
-    shuffle(options, options + 4, default_random_engine(seed));
-
-    for(int i=0;i<4;i++)
+    if (resumed)
     {
-        cout << i+1 << ". " << options[i] << endl;
+        difficulty = DIFFICULTY_NAMES[session.rank];
+        tags = session.tags;
     }
-    int opt;
-    cout << "Choose: " ;
-    cin >> opt; 
-
-    if(options[opt-1] == ans)
+    else
     {
-        cout << "Correct Answer!!! " << endl;
-        return true;
+        cout << "Select Quiz difficuly(easy,medium,hard,expr), optionally with tags (e.g. hard,non-regular,unambiguous) : ";
+        cin >> difficulty;
     }
-    else
+    if (difficulty.find(',') != string::npos)
     {
-        cout << "Better Luck Next Time!!!" << endl;
-        return false;
+        tags = difficulty.substr(difficulty.find(',') + 1);
+        difficulty = difficulty.substr(0, difficulty.find(','));
     }
-}
-
-bool type2()
-{
-    int try_counter = 0;
-    srand(time(NULL));
-    int it = rand()%cfg_arr.size();
-    
-    cout << "Select the valid string from the followiing CFG :\n" << cfg_arr[it] << endl;
-
-    string options[4];
-    options[0] = cfg_arr[it].generateString(6);
-
-    cout << options[0] << " ANS here " << endl;
-    string ans = options[0];
-
-    for(int j=1;j<4;j++)
+    if(difficulty == "easy" || difficulty == "medium" || difficulty == "hard")
     {
-        try_again:
-        std::random_device rd;
-        int it2 = rd() % cfg_arr.size();
-        //int it2 = rand()%cfg_arr.size();
-        if(it2 == it)
-        {
-            //cout << "we are trying again " << endl;
-            try_counter++;
-            goto try_again;
-        }
-
-        options[j] = cfg_arr[it2].generateString(6);
-        if(cfg_arr[it].isValidString(options[j])) // try again if the give string is 'valid'. we want invalid strings
+        difficulty_rank = difficulty == "easy" ? 0 : difficulty == "medium" ? 1 : 2;
+        difficulty = BANK_FILES[difficulty_rank];
+        if (!resumed) session.bankSeed = quizRandom()();
+        bank = loadQuizBank(difficulty_rank, tags, session.bankSeed);
+        if (!bank)
         {
-            //cout << "we are trying again " << endl;
-            try_counter++;
-            goto try_again;
+            return;
         }
     }
-    
-    unsigned seed = chrono::system_clock::now().time_since_epoch().count();
-    shuffle(options, options + 4, default_random_engine(seed));
-
-    for(int i=0;i<4;i++)
+    else if(difficulty == "expr")
     {
-        cout << i+1 << ". " << options[i] << endl;
+        difficulty = "expr_cfgs.txt";
+        difficulty_rank = 3;
+        sym_arr.clear();
+        if (!readSymbolGrammarsFromFile("expr_cfgs.txt", sym_arr) || sym_arr.empty())
+        {
+            cout << "Could not load expr_cfgs.txt." << endl;
+            return;
+        }
     }
-    int opt;
-    cout << "Choose: " ;
-    cin >> opt; 
-
-    if(options[opt-1] == ans)
+    else
     {
-        cout << "Correct Answer!!! " << endl;
-        return true;
+        cout <<"Invalid Difficulty Option." << endl;
+        return;
     }
-    else
+    bool symbolic = difficulty_rank == 3; // token-level grammars only support types 1 and 2
+    if (logging && !resumed && !sessionLog.begin(session, difficulty_rank, tags, session.bankSeed))
     {
-        cout << "Better Luck Next Time!!!" << endl;
-        return false;
+        cout << "Could not write " << SESSION_LOG_FILE << "; this quiz cannot be resumed if interrupted." << endl;
+        logging = false;
     }
+
+    auto ask = [](const Question& q, string& reply) { return askQuestion(q, cin, cout, &reply); };
+    int points = runQuizSession(bank, symbolic, ask, cout, nullptr, logging ? &sessionLog : nullptr, &session);
+    recordScore(difficulty_rank, points);
+    writeScoreFromFile();
+    cout << endl << "You Scored : " << points << endl;
+    getchar();
 }
 
-bool type3()
+// Lists the sessions in sessions.wal, then walks one through question by question: what was
+// asked, what the student answered, the score that adds up to, and whether the question still
+// rebuilds the same from its seed, in the working set redrawn from the session's bank seed.
+void Replay_Sessions()
 {
-    std::random_device rd;
-    int it = rd() % cfg_arr.size();
-    string str = cfg_arr[it].generateString(6);
-    cout << "Derive the following string \'" << str << "\' using the given CFG\n Use left Expansion method" << endl;
-    cout << cfg_arr[it] << endl;
+    vector<LoggedSession> sessions;
+    if (!SessionLog::read(SESSION_LOG_FILE, sessions) || sessions.empty())
+    {
+        cout << "No sessions logged in " << SESSION_LOG_FILE << "." << endl;
+        return;
+    }
+    for (const LoggedSession& s : sessions)
+    {
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&s.started));
+        cout << s.id << ". " << when << " " << (s.rank >= 0 && s.rank <= 3 ? DIFFICULTY_NAMES[s.rank] : "?")
+             << (s.tags.empty() ? "" : "," + s.tags) << ", " << s.questions.size() << " questions, "
+             << (s.abandoned ? "abandoned" : s.ended ? "scored " + to_string(s.points) : "unfinished") << endl;
+    }
+    uint64_t id;
+    cout << "Session to replay : ";
+    cin >> id;
+    auto found = find_if(sessions.begin(), sessions.end(), [&](const LoggedSession& s) { return s.id == id; });
+    if (found == sessions.end() || found->rank < 0 || found->rank > 3)
+    {
+        cout << "No such session." << endl;
+        return;
+    }
 
-    vector<string> mod = cfg_arr[it].deriveLeftmost(str);
-    vector<string> ans;
-    string opt;
-    cout << "Enter 'done' when final answer reached" << endl;
-    while(1)
+    const LoggedSession& s = *found;
+    BankRef bank;
+    unordered_map<uint64_t, int> byText; // grammar text hash -> index in the bank
+    if (s.rank < 3)
     {
-        cin >> opt;
-        if(opt == "done")
+        bank = loadQuizBank(s.rank, s.tags, s.bankSeed);
+        for (int i = 0; bank && i < (int)bank->grammars.size(); i++)
         {
-            break;
+            ostringstream text;
+            text << bank->grammars[i];
+            byText[fnv1a(text.str())] = i;
         }
-        ans.push_back(opt);
     }
-    
-    if(ans == mod)
+    else if (sym_arr.empty())
     {
-        cout << "Correct Answer!!" << endl;
-        return true;
+        readSymbolGrammarsFromFile("expr_cfgs.txt", sym_arr);
     }
-    else
+
+    // Rebuilding is deterministic only with step budgets; the quiz's randomness is put back after.
+    bool savedReproducible = reproducibleRuns;
+    mt19937 savedRandom = quizRandom();
+    reproducibleRuns = true;
+    QuizProgress progress;
+    for (int i = 0; i < (int)s.questions.size(); i++)
     {
-        cout << "Better Luck Next Time!" << endl;
-        return false;
+        const LoggedQuestion& lq = s.questions[i];
+        cout << endl << "Question " << i + 1 << ": ";
+        if (lq.type == 0)
+        {
+            cout << "skipped" << endl;
+            progress.skipped();
+            continue;
+        }
+        progress.answered(lq.correct);
+        cout << "type " << lq.type << ", grammar " << hex << lq.grammar << dec << ", seed " << lq.seed << endl;
+        cout << "  " << (lq.type <= 2 ? "answer  " : "derive  ") << lq.answer << endl;
+        cout << "  reply   " << lq.reply << (lq.correct ? "  (correct)" : "  (wrong)") << endl;
+        cout << "  built in " << lq.buildMs << " ms, answered in " << lq.answerMs << " ms; "
+             << progress.points << " points, streak " << progress.streak << endl;
+
+        Question q;
+        Budget budget = Budget::forMillis(ATTEMPT_DEADLINE_MS, ATTEMPT_STEP_BUDGET);
+        bool rebuilt;
+        if (s.rank < 3)
+        {
+            auto grammar = byText.find(lq.grammar);
+            if (grammar == byText.end())
+            {
+                cout << "  grammar no longer in the quiz's working set of " << BANK_FILES[s.rank] << endl;
+                continue;
+            }
+            rebuilt = buildQuestion(bank->grammars, grammar->second, lq.type, lq.seed, q, budget) == OpStatus::Ok;
+        }
+        else
+        {
+            quizRandom().seed(lq.seed);
+            rebuilt = !sym_arr.empty() && buildSymbolicQuestion(lq.type, q, budget) == OpStatus::Ok && fnv1a(q.grammarText) == lq.grammar;
+        }
+        rebuilt = rebuilt && (lq.type <= 2 ? q.answer : q.target) == lq.answer;
+        cout << (rebuilt ? "  rebuilds identically" : "  rebuilds differently (grammar or generator changed)") << endl;
     }
+    reproducibleRuns = savedReproducible;
+    quizRandom() = savedRandom;
+
+    cout << endl << "Replayed score: " << progress.points;
+    if (s.ended) cout << (progress.points == s.points ? " (matches the log)" : " (log says " + to_string(s.points) + ")");
+    cout << endl;
 }
 
-bool type4()
+// ---------------------------------------------------------------------------------------------
+// Load test: quiz --loadtest students=1000 threads=8 difficulty=hard accuracy=0.7 think=20 seed=1
+// Runs whole quiz sessions (scheduler, question building, askQuestion, leaderboard) for simulated
+// students whose replies are scripted into askQuestion's input stream. Session s always draws
+// from seed and s, and worker w runs sessions w, w+threads, ... with its own cost model, so a
+// seed and thread count reproduce the same questions; the digest in the report shows it.
+// Scores go to the in-memory leaderboard only, never to Scoreboard.txt.
+// ---------------------------------------------------------------------------------------------
+
+struct LoadTestConfig
 {
-    std::random_device rd;
-    int it = rd() % cfg_arr.size();
-    string str = cfg_arr[it].generateString(6);
-    cout << "Derive the following string \'" << str << "\' using the given CFG\n Use Right Expansion method" << endl;
-    cout << cfg_arr[it] << endl;
+    int students = 100;
+    int threads = 4;
+    string difficulty = "easy"; // as typed at the quiz prompt, tags included
+    double accuracy = 0.7;      // chance a simulated student answers correctly
+    int thinkMs = 0;            // mean time a student spends on a question
+    uint32_t seed = 1;
+    string report = "loadtest_report.txt";
+    string wal;                 // session log to write, none when empty
+};
 
-    vector<string> mod = cfg_arr[it].deriveRightmost(str);
-    vector<string> ans;
-    string opt;
-    cout << "Enter 'done' when final answer reached" << endl;
-    while(1)
+bool parseLoadTestArgs(int argc, char** argv, LoadTestConfig& config)
+{
+    for (int i = 2; i < argc; i++)
     {
-        cin >> opt;
-        if(opt == "done")
-        {
-            break;
-        }
-        ans.push_back(opt);
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == string::npos) return false;
+        string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+        if (key == "students") config.students = stoi(value);
+        else if (key == "threads") config.threads = stoi(value);
+        else if (key == "difficulty") config.difficulty = value;
+        else if (key == "accuracy") config.accuracy = stod(value);
+        else if (key == "think") config.thinkMs = stoi(value);
+        else if (key == "seed") config.seed = stoul(value);
+        else if (key == "report") config.report = value;
+        else if (key == "wal") config.wal = value;
+        else return false;
     }
-    
-    if(ans == mod)
+    return config.students > 0 && config.threads > 0;
+}
+
+// What a student would type at askQuestion: right with probability accuracy.
+string scriptedReply(const Question& q, double accuracy, mt19937& rng)
+{
+    bool right = uniform_real_distribution<double>(0, 1)(rng) < accuracy;
+    ostringstream script;
+    if (q.type == 1 || q.type == 2)
     {
-        cout << "Correct Answer!!" << endl;
-        return true;
+        vector<int> picks;
+        for (int i = 0; i < (int)q.options.size(); i++)
+        {
+            if ((q.options[i] == q.answer) == right) picks.push_back(i + 1);
+        }
+        script << (picks.empty() ? 0 : picks[rng() % picks.size()]) << "\n";
+        return script.str();
     }
-    else
+    vector<string> steps = q.derivation;
+    if (!right)
     {
-        cout << "Better Luck Next Time!" << endl;
-        return false;
+        if (steps.empty()) steps.push_back("?");
+        else steps.pop_back();
     }
+    for (const string& step : steps) script << step << "\n";
+    script << "done\n";
+    return script.str();
 }
 
-void Quiz()
+// Peak resident set size of the process in KiB, -1 where the platform does not report it.
+long peakRssKb()
 {
-    string difficulty;
-    int difficulty_rank;
-    cout << "Select Quiz difficuly(easy,medium,hard) : ";
-    cin >> difficulty;
-    if(difficulty == "easy")
-    {
-        difficulty = "easy_cfgs.txt";
-        difficulty_rank = 0;
-        readGrammarArrayFromFile("easy_cfgs.txt");
-    }
-    else if(difficulty == "medium")
+#ifdef __linux__
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
     {
-        difficulty = "medium_cfgs.txt";
-        difficulty_rank = 1;
-        readGrammarArrayFromFile("medium_cfgs.txt");
+        if (line.compare(0, 6, "VmHWM:") == 0) return stol(line.substr(6));
     }
-    else if(difficulty == "hard")
+#endif
+    return -1;
+}
+
+int Load_Test(int argc, char** argv)
+{
+    LoadTestConfig config;
+    if (!parseLoadTestArgs(argc, argv, config))
     {
-        difficulty = "hard_cfgs.txt";
-        difficulty_rank = 2;
-        readGrammarArrayFromFile("hard_cfgs.txt");
+        cout << "usage: " << argv[0] << " --loadtest [students=N] [threads=N] [difficulty=easy|medium|hard|expr[,tags]]"
+             << " [accuracy=0..1] [think=ms] [seed=N] [report=file] [wal=file]" << endl;
+        return 1;
     }
-    else
+    reproducibleRuns = true;
+    quizRandom().seed(config.seed);
+
+    string difficulty = config.difficulty, tags;
+    if (difficulty.find(',') != string::npos)
     {
-        cout <<"Invalid Difficulty Option." << endl;
-        return;
+        tags = difficulty.substr(difficulty.find(',') + 1);
+        difficulty = difficulty.substr(0, difficulty.find(','));
     }
+    int rank = difficulty == "easy" ? 0 : difficulty == "medium" ? 1 : difficulty == "hard" ? 2 : difficulty == "expr" ? 3 : -1;
+    BankRef bank;
+    if (rank < 0) return cout << "Invalid Difficulty Option." << endl, 1;
+    if (rank == 3 && (!readSymbolGrammarsFromFile("expr_cfgs.txt", sym_arr) || sym_arr.empty())) return cout << "Could not load expr_cfgs.txt." << endl, 1;
+    uint32_t bankSeed = quizRandom()();
+    if (rank < 3 && !(bank = loadQuizBank(rank, tags, bankSeed))) return 1;
 
-    int streak=0, points=0;
-    bool ret;
-    std::random_device rd;
-    for(int i=0; i<10;i++)
+    struct SessionResult { int points = 0, correct = 0, skipped = 0; int types[5] = {}; uint64_t digest = 0; };
+    vector<SessionResult> results(config.students);
+    vector<vector<double>> latencies(config.threads);
+    vector<unique_ptr<CostModel>> models;
+    for (int w = 0; w < config.threads; w++) models.emplace_back(new CostModel());
+    long rssBefore = peakRssKb();
+    SessionLog log;
+    vector<LoggedSession> recovered;
+    if (!config.wal.empty() && !log.open(config.wal, recovered)) return cout << "Could not open " << config.wal << "." << endl, 1;
+
+    auto worker = [&](int w)
     {
-        int it = rd()%5;
-        switch(it)
-        {
-            case 1:
-                ret = type1(); // guess invalid string
-                cout << endl;
-                break;
-            case 2:
-                ret = type2(); // guess invalid string
-                cout << endl;
-                break;
-            case 3:
-                ret = type3(); // guess derivation
-                cout << endl;
-                break;
-            case 4:
-                ret = type4();
-                cout << endl;
-        }
-        if(ret)
+        threadCostModel = models[w].get();
+        ostream sink(nullptr); // the questions' text is built and discarded
+        for (int s = w; s < config.students; s += config.threads)
         {
-            streak++;
-            points += 1*streak;
-        }
-        else
-        {
-            streak=0;
+            quizRandom().seed(config.seed * 1000003u + s);
+            mt19937 student(config.seed ^ (0x9E3779B9u * (s + 1)));
+            SessionResult& r = results[s];
+            r.digest = fnv1a("");
+            auto ask = [&](const Question& q, string& reply)
+            {
+                if (config.thinkMs > 0)
+                {
+                    this_thread::sleep_for(chrono::milliseconds(uniform_int_distribution<int>(config.thinkMs / 2, config.thinkMs * 3 / 2)(student)));
+                }
+                istringstream in(scriptedReply(q, config.accuracy, student));
+                bool right = askQuestion(q, in, sink, &reply);
+                r.correct += right;
+                return right;
+            };
+            auto built = [&](const Question* q, double ms)
+            {
+                latencies[w].push_back(ms);
+                if (!q)
+                {
+                    r.skipped++;
+                    return;
+                }
+                r.types[q->type]++;
+                r.digest = fnv1a(to_string(q->type) + q->grammarText + q->answer + q->target, r.digest);
+                for (const string& o : q->options) r.digest = fnv1a(o, r.digest);
+            };
+            LoggedSession session;
+            bool logging = log.isOpen() && log.begin(session, rank, tags, bankSeed);
+            r.points = runQuizSession(bank, rank == 3, ask, sink, built, logging ? &log : nullptr, &session);
+            recordScore(rank, r.points);
         }
-        continue;
+        threadCostModel = nullptr;
+    };
+
+    auto started = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int w = 1; w < config.threads; w++) threads.emplace_back(worker, w);
+    worker(0);
+    for (thread& t : threads) t.join();
+    double wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    log.close();
+    SessionLog::Stats wal = log.stats();
+
+    vector<double> all;
+    for (auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all.empty() ? 0.0 : all[min(all.size() - 1, size_t(p * all.size()))]; };
+    long long points = 0, correct = 0, skipped = 0, types[5] = {};
+    uint64_t digest = fnv1a("");
+    for (const SessionResult& r : results)
+    {
+        points += r.points;
+        correct += r.correct;
+        skipped += r.skipped;
+        for (int t = 1; t <= 4; t++) types[t] += r.types[t];
+        digest = fnv1a(to_string(r.digest), digest);
     }
-    leaderboard[difficulty_rank].insert(points);
-    writeScoreFromFile();
-    cout << endl << "You Scored : " << points << endl;
-    getchar();
+    ResultCache::Stats cache = resultCache.stats();
+    CostModel::Stats builds;
+    for (auto& m : models)
+    {
+        CostModel::Stats s = m->stats();
+        builds.attempts += s.attempts;
+        builds.failed += s.failed;
+        builds.maxSteps = max(builds.maxSteps, s.maxSteps);
+    }
+
+    ostringstream report;
+    report << "loadtest_version 1\n"
+           << "seed " << config.seed << "\nstudents " << config.students << "\nthreads " << config.threads
+           << "\ndifficulty " << config.difficulty << "\naccuracy " << config.accuracy << "\nthink_ms " << config.thinkMs
+           << "\n# reproducible for the settings above\n"
+           << "question_digest " << hex << digest << dec << "\nquestions " << all.size() - skipped << "\nskipped " << skipped
+           << "\ntype1 " << types[1] << "\ntype2 " << types[2] << "\ntype3 " << types[3] << "\ntype4 " << types[4]
+           << "\ncorrect " << correct << "\npoints_mean " << double(points) / config.students
+           << "\nbuild_attempts " << builds.attempts << "\nbuild_attempts_failed " << builds.failed
+           << "\nbuild_steps_max " << builds.maxSteps << "\nattempt_step_budget " << ATTEMPT_STEP_BUDGET
+           << "\n# timing and memory\n"
+           << "wall_ms " << wallMs << "\nsessions_per_s " << config.students * 1000.0 / wallMs
+           << "\nquestions_per_s " << all.size() * 1000.0 / wallMs
+           << "\nbuild_ms_p50 " << percentile(0.50) << "\nbuild_ms_p90 " << percentile(0.90)
+           << "\nbuild_ms_p99 " << percentile(0.99) << "\nbuild_ms_p999 " << percentile(0.999)
+           << "\nbuild_ms_max " << (all.empty() ? 0.0 : all.back())
+           << "\npeak_rss_kb_before " << rssBefore << "\npeak_rss_kb " << peakRssKb()
+           << "\ncache_hits " << cache.hits << "\ncache_misses " << cache.misses
+           << "\nwal_records " << wal.records << "\nwal_syncs " << wal.syncs << "\nwal_bytes " << wal.bytes << "\n";
+    cout << report.str();
+    ofstream(config.report) << report.str();
+    cout << "Report written to " << config.report << endl;
+    return 0;
 }
 
 void test_fun()
 {
+    const vector<CFG>& cfg_arr = grammarBank.current(0)->grammars;
     // cout << cfg_arr[1].isValidString("aaabbb") << endl;
     // cout << cfg_arr[0].isValidString("aaacccbbdd") << endl;
     // cout << cfg_arr[0].isValidString("aaacc") << endl;
@@ -938,12 +5381,21 @@ void test_fun()
     }
 }
 
-int main() 
+int main(int argc, char** argv) 
 {
     srand(time(0));
     int opt;
 
-    readGrammarArrayFromFile("easy_cfgs.txt");
+#ifdef CFG_METRICS
+    if (getenv("CFG_TRACE")) metricRegistry().tracing = true; // record Chrome trace spans
+    atexit(Dump_Metrics);
+#endif
+
+    grammarBank.loadAll(cout);
+    if (argc > 1 && string(argv[1]) == "--loadtest")
+    {
+        return Load_Test(argc, argv);
+    }
     readScoreFromFile();
 
     sos:
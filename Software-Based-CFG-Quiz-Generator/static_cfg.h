@@ -0,0 +1,557 @@
+#ifndef STATIC_CFG_H
+#define STATIC_CFG_H
+
+// Compile-time grammars. A grammar in the bank file format (START / RULES / END, one
+// "X -> X alt alt ..." line per non-terminal, "empty" for the empty alternative) is parsed by
+// static_cfg::parse inside a constant expression:
+//
+//     static constexpr static_cfg::Grammar anbn = static_cfg::parse("START S\nRULES 1\nS -> S aSb empty\nEND\n");
+//     static_cfg::StaticEngine<anbn> engine;
+//
+// Nullable, FIRST, FOLLOW, minimum lengths and the LL(1) table are constexpr arrays. For LL(1)
+// grammars the recognizer is a recursive-descent parser instantiated per non-terminal, where the
+// choice of alternative is a switch over the alternatives known at compile time; other grammars
+// use a span table driven by the same constexpr tables. Both implement GrammarEngine, the
+// interface the runtime CFG is adapted to, so they can be benchmarked side by side.
+
+#include <string>
+#include <vector>
+#include <random>
+#include <utility>
+
+// Common interface of the runtime CFG and the compile-time grammars.
+class GrammarEngine
+{
+public:
+    virtual ~GrammarEngine() = default;
+    virtual bool isValidString(const std::string& input) = 0;
+    virtual std::string generateString(int maxDepth) = 0;
+    virtual const char* engineName() const = 0;
+};
+
+namespace static_cfg
+{
+
+constexpr int MAX_NT = 16;
+constexpr int MAX_ALTS = 64;
+constexpr int MAX_ALT_LEN = 16;
+constexpr int MAX_TERMS = 32;
+constexpr int END_MARK = MAX_TERMS; // column of the end-of-input marker in follow/ll1
+constexpr int NO_ALT = -1;
+constexpr int CONFLICT = -2;
+constexpr int INF_LEN = 1 << 20;
+
+struct Grammar
+{
+    bool ok;             // false if the text did not parse, exceeded the fixed limits, or has a
+                         // non-terminal that derives no string
+    int ntCount;
+    char ntName[MAX_NT];
+    int start;
+    int altBegin[MAX_NT]; // alternatives of non-terminal A are [altBegin[A], altEnd[A])
+    int altEnd[MAX_NT];
+    int altCount;
+    int altLen[MAX_ALTS];
+    int altSym[MAX_ALTS][MAX_ALT_LEN]; // >= 0 non-terminal id, < 0 is ~terminal id
+    int termCount;
+    char term[MAX_TERMS];
+    int termOf[256];     // character -> terminal id, or -1
+
+    bool nullable[MAX_NT];
+    bool first[MAX_NT][MAX_TERMS];
+    bool follow[MAX_NT][MAX_TERMS + 1];
+    int minLen[MAX_NT];
+    int altMinLen[MAX_ALTS];
+    int minHeight[MAX_NT];  // height of the lowest derivation tree, INF_LEN if there is none
+    int altHeight[MAX_ALTS];
+    int ll1[MAX_NT][MAX_TERMS + 1]; // predicted alternative, NO_ALT or CONFLICT
+    bool isLL1;
+};
+
+namespace detail
+{
+
+constexpr bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+constexpr int skipSpaces(const char* s, int i)
+{
+    while (s[i] && isSpace(s[i])) i++;
+    return i;
+}
+
+constexpr int lineEnd(const char* s, int i)
+{
+    while (s[i] && s[i] != '\n') i++;
+    return i;
+}
+
+constexpr bool startsWith(const char* s, int i, const char* word)
+{
+    for (int k = 0; word[k]; k++)
+    {
+        if (s[i + k] != word[k]) return false;
+    }
+    return true;
+}
+
+// "S' -> S' S" is the augmented start the runtime CFG adds; compile-time grammars skip it.
+constexpr bool isAugmentedKey(const char* s, int i)
+{
+    return s[i] && s[i + 1] == '\'';
+}
+
+constexpr void computeTables(Grammar& g)
+{
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (int A = 0; A < g.ntCount; A++)
+        {
+            for (int a = g.altBegin[A]; a < g.altEnd[A]; a++)
+            {
+                bool prefixNullable = true;
+                for (int k = 0; k < g.altLen[a] && prefixNullable; k++)
+                {
+                    int sym = g.altSym[a][k];
+                    if (sym < 0)
+                    {
+                        if (!g.first[A][~sym]) g.first[A][~sym] = changed = true;
+                        prefixNullable = false;
+                    }
+                    else
+                    {
+                        for (int t = 0; t < g.termCount; t++)
+                        {
+                            if (g.first[sym][t] && !g.first[A][t]) g.first[A][t] = changed = true;
+                        }
+                        prefixNullable = g.nullable[sym];
+                    }
+                }
+                if (prefixNullable && !g.nullable[A]) g.nullable[A] = changed = true;
+            }
+        }
+    }
+
+    g.follow[g.start][END_MARK] = true;
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (int A = 0; A < g.ntCount; A++)
+        {
+            for (int a = g.altBegin[A]; a < g.altEnd[A]; a++)
+            {
+                for (int k = 0; k < g.altLen[a]; k++)
+                {
+                    int B = g.altSym[a][k];
+                    if (B < 0) continue;
+                    bool restNullable = true;
+                    for (int r = k + 1; r < g.altLen[a] && restNullable; r++)
+                    {
+                        int sym = g.altSym[a][r];
+                        if (sym < 0)
+                        {
+                            if (!g.follow[B][~sym]) g.follow[B][~sym] = changed = true;
+                            restNullable = false;
+                        }
+                        else
+                        {
+                            for (int t = 0; t < g.termCount; t++)
+                            {
+                                if (g.first[sym][t] && !g.follow[B][t]) g.follow[B][t] = changed = true;
+                            }
+                            restNullable = g.nullable[sym];
+                        }
+                    }
+                    if (restNullable)
+                    {
+                        for (int t = 0; t <= MAX_TERMS; t++)
+                        {
+                            if (g.follow[A][t] && !g.follow[B][t]) g.follow[B][t] = changed = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for (int A = 0; A < g.ntCount; A++) g.minLen[A] = INF_LEN;
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (int A = 0; A < g.ntCount; A++)
+        {
+            for (int a = g.altBegin[A]; a < g.altEnd[A]; a++)
+            {
+                int len = 0;
+                for (int k = 0; k < g.altLen[a] && len < INF_LEN; k++)
+                {
+                    int sym = g.altSym[a][k];
+                    len += sym < 0 ? 1 : g.minLen[sym];
+                }
+                if (len > INF_LEN) len = INF_LEN;
+                g.altMinLen[a] = len;
+                if (len < g.minLen[A])
+                {
+                    g.minLen[A] = len;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Unlike the shortest alternative, the lowest one only uses non-terminals of smaller height,
+    // so always taking it ends (A -> AA | empty has two shortest alternatives, one of them A -> AA).
+    for (int A = 0; A < g.ntCount; A++) g.minHeight[A] = INF_LEN;
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (int A = 0; A < g.ntCount; A++)
+        {
+            for (int a = g.altBegin[A]; a < g.altEnd[A]; a++)
+            {
+                int height = 1;
+                for (int k = 0; k < g.altLen[a]; k++)
+                {
+                    int sym = g.altSym[a][k];
+                    if (sym >= 0 && g.minHeight[sym] + 1 > height) height = g.minHeight[sym] + 1;
+                }
+                if (height > INF_LEN) height = INF_LEN;
+                g.altHeight[a] = height;
+                if (height < g.minHeight[A])
+                {
+                    g.minHeight[A] = height;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    g.isLL1 = true;
+    for (int A = 0; A < g.ntCount; A++)
+    {
+        for (int t = 0; t <= MAX_TERMS; t++) g.ll1[A][t] = NO_ALT;
+        for (int a = g.altBegin[A]; a < g.altEnd[A]; a++)
+        {
+            bool predicts[MAX_TERMS + 1] = {};
+            bool altNullable = true;
+            for (int k = 0; k < g.altLen[a] && altNullable; k++)
+            {
+                int sym = g.altSym[a][k];
+                if (sym < 0)
+                {
+                    predicts[~sym] = true;
+                    altNullable = false;
+                }
+                else
+                {
+                    for (int t = 0; t < g.termCount; t++) predicts[t] = predicts[t] || g.first[sym][t];
+                    altNullable = g.nullable[sym];
+                }
+            }
+            if (altNullable)
+            {
+                for (int t = 0; t <= MAX_TERMS; t++) predicts[t] = predicts[t] || g.follow[A][t];
+            }
+            for (int t = 0; t <= MAX_TERMS; t++)
+            {
+                if (!predicts[t]) continue;
+                if (g.ll1[A][t] == NO_ALT) g.ll1[A][t] = a;
+                else
+                {
+                    g.ll1[A][t] = CONFLICT;
+                    g.isLL1 = false;
+                }
+            }
+        }
+    }
+}
+
+} // namespace detail
+
+constexpr Grammar parse(const char* s)
+{
+    Grammar g{};
+    g.ok = false;
+    for (int c = 0; c < 256; c++) g.termOf[c] = -1;
+
+    int i = detail::skipSpaces(s, 0);
+    while (s[i] == '\n') i = detail::skipSpaces(s, i + 1);
+    if (!detail::startsWith(s, i, "START ")) return g;
+    i = detail::skipSpaces(s, i + 6);
+    char startName = s[i];
+    i = detail::lineEnd(s, i);
+    if (!s[i]) return g;
+    i = detail::skipSpaces(s, i + 1);
+    if (!detail::startsWith(s, i, "RULES")) return g;
+    i = detail::lineEnd(s, i);
+    int rulesBegin = s[i] ? i + 1 : i;
+
+    // Pass 1: every rule key is a non-terminal.
+    for (int p = rulesBegin; s[p]; p = s[detail::lineEnd(s, p)] ? detail::lineEnd(s, p) + 1 : detail::lineEnd(s, p))
+    {
+        p = detail::skipSpaces(s, p);
+        if (detail::startsWith(s, p, "END")) break;
+        if (s[p] == '\n' || !s[p] || detail::isAugmentedKey(s, p)) continue;
+        if (g.ntCount == MAX_NT) return g;
+        g.ntName[g.ntCount++] = s[p];
+    }
+
+    auto ntIndex = [&g](char c) constexpr {
+        for (int A = 0; A < g.ntCount; A++)
+        {
+            if (g.ntName[A] == c) return A;
+        }
+        return -1;
+    };
+
+    g.start = ntIndex(startName);
+    if (g.start < 0) return g;
+
+    // Pass 2: alternatives. The word after "->" repeats the key and is skipped.
+    for (int p = rulesBegin; s[p]; p = s[detail::lineEnd(s, p)] ? detail::lineEnd(s, p) + 1 : detail::lineEnd(s, p))
+    {
+        p = detail::skipSpaces(s, p);
+        if (detail::startsWith(s, p, "END")) break;
+        if (s[p] == '\n' || !s[p] || detail::isAugmentedKey(s, p)) continue;
+        int A = ntIndex(s[p]);
+        int end = detail::lineEnd(s, p);
+        int q = p;
+        while (q < end && !detail::startsWith(s, q, "->")) q++;
+        if (q >= end) return g;
+        q = detail::skipSpaces(s, q + 2);
+        while (q < end && !detail::isSpace(s[q])) q++; // repeated key
+        g.altBegin[A] = g.altCount;
+        while (true)
+        {
+            q = detail::skipSpaces(s, q);
+            if (q >= end) break;
+            if (g.altCount == MAX_ALTS) return g;
+            int a = g.altCount++;
+            if (detail::startsWith(s, q, "empty") && (q + 5 >= end || detail::isSpace(s[q + 5])))
+            {
+                q += 5;
+                continue;
+            }
+            while (q < end && !detail::isSpace(s[q]))
+            {
+                if (g.altLen[a] == MAX_ALT_LEN) return g;
+                char c = s[q++];
+                int B = ntIndex(c);
+                if (B < 0)
+                {
+                    unsigned char uc = (unsigned char)c;
+                    if (g.termOf[uc] < 0)
+                    {
+                        if (g.termCount == MAX_TERMS) return g;
+                        g.termOf[uc] = g.termCount;
+                        g.term[g.termCount++] = c;
+                    }
+                    B = ~g.termOf[uc];
+                }
+                g.altSym[a][g.altLen[a]++] = B;
+            }
+        }
+        g.altEnd[A] = g.altCount;
+    }
+
+    detail::computeTables(g);
+    for (int A = 0; A < g.ntCount; A++)
+    {
+        if (g.minHeight[A] == INF_LEN) return g; // expand() would have no way out of A
+    }
+    g.ok = true;
+    return g;
+}
+
+// ---- Recursive descent for LL(1) grammars -----------------------------------------------------
+
+struct Cursor
+{
+    const char* p;
+    const char* end;
+};
+
+template <const Grammar& G>
+constexpr int lookahead(const Cursor& c)
+{
+    return c.p == c.end ? END_MARK : G.termOf[(unsigned char)*c.p];
+}
+
+template <const Grammar& G, int A>
+bool parseNT(Cursor& c);
+
+template <const Grammar& G, int Alt, int K>
+bool parseAlt(Cursor& c)
+{
+    if constexpr (K == G.altLen[Alt])
+    {
+        return true;
+    }
+    else
+    {
+        constexpr int sym = G.altSym[Alt][K];
+        if constexpr (sym < 0)
+        {
+            if (c.p == c.end || *c.p != G.term[~sym]) return false;
+            c.p++;
+        }
+        else
+        {
+            if (!parseNT<G, sym>(c)) return false;
+        }
+        return parseAlt<G, Alt, K + 1>(c);
+    }
+}
+
+template <const Grammar& G, int A, int... K>
+bool dispatchAlt(int alt, Cursor& c, std::integer_sequence<int, K...>)
+{
+    bool result = false;
+    (void)((alt == G.altBegin[A] + K ? (result = parseAlt<G, G.altBegin[A] + K, 0>(c), true) : false) || ...);
+    return result;
+}
+
+template <const Grammar& G, int A>
+bool parseNT(Cursor& c)
+{
+    int t = lookahead<G>(c);
+    if (t < 0) return false;
+    int alt = G.ll1[A][t];
+    if (alt < 0) return false;
+    return dispatchAlt<G, A>(alt, c, std::make_integer_sequence<int, G.altEnd[A] - G.altBegin[A]>{});
+}
+
+// ---- Span table for the remaining grammars ----------------------------------------------------
+
+// derives[A][i][j]: non-terminal A derives input[i..j). Spans are filled by increasing length;
+// within one span the non-terminals are iterated to a fixpoint to cover unit and nullable chains.
+template <const Grammar& G>
+bool recognizeSpans(const std::string& in)
+{
+    int n = in.size();
+    for (char ch : in)
+    {
+        if (G.termOf[(unsigned char)ch] < 0) return false;
+    }
+    auto at = [n](int A, int i, int j) { return ((size_t)A * (n + 1) + i) * (n + 1) + j; };
+    std::vector<char> derives((size_t)G.ntCount * (n + 1) * (n + 1), 0);
+    for (int A = 0; A < G.ntCount; A++)
+    {
+        for (int i = 0; i <= n; i++) derives[at(A, i, i)] = G.nullable[A];
+    }
+
+    std::vector<char> cur(n + 1), next(n + 1);
+    for (int len = 1; len <= n; len++)
+    {
+        for (int i = 0; i + len <= n; i++)
+        {
+            int j = i + len;
+            for (bool changed = true; changed; )
+            {
+                changed = false;
+                for (int A = 0; A < G.ntCount; A++)
+                {
+                    if (derives[at(A, i, j)] || G.minLen[A] > len) continue;
+                    for (int a = G.altBegin[A]; a < G.altEnd[A] && !derives[at(A, i, j)]; a++)
+                    {
+                        if (G.altMinLen[a] > len) continue;
+                        // Positions reachable after matching a prefix of the alternative.
+                        std::fill(cur.begin(), cur.end(), 0);
+                        cur[i] = 1;
+                        for (int k = 0; k < G.altLen[a]; k++)
+                        {
+                            std::fill(next.begin(), next.end(), 0);
+                            int sym = G.altSym[a][k];
+                            for (int m = i; m <= j; m++)
+                            {
+                                if (!cur[m]) continue;
+                                if (sym < 0)
+                                {
+                                    if (m < j && in[m] == G.term[~sym]) next[m + 1] = 1;
+                                }
+                                else
+                                {
+                                    for (int e = m; e <= j; e++)
+                                    {
+                                        if (derives[at(sym, m, e)]) next[e] = 1;
+                                    }
+                                }
+                            }
+                            std::swap(cur, next);
+                        }
+                        if (cur[j]) derives[at(A, i, j)] = changed = true;
+                    }
+                }
+            }
+        }
+    }
+    return derives[at(G.start, 0, n)];
+}
+
+template <const Grammar& G>
+bool recognize(const std::string& in)
+{
+    if constexpr (G.isLL1)
+    {
+        Cursor c{in.data(), in.data() + in.size()};
+        return parseNT<G, G.start>(c) && c.p == c.end;
+    }
+    else
+    {
+        return recognizeSpans<G>(in);
+    }
+}
+
+// Random derivation; once depth runs out every non-terminal takes its lowest alternative, whose
+// non-terminals are all lower than it, so generation always terminates (parse rejects grammars
+// with a non-terminal that derives nothing; unlike the runtime generator, no retries are needed).
+template <const Grammar& G, class Rng>
+void expand(int A, int depth, Rng& rng, std::string& out)
+{
+    int count = G.altEnd[A] - G.altBegin[A];
+    int alt = G.altBegin[A];
+    if (depth > 0)
+    {
+        alt += std::uniform_int_distribution<int>(0, count - 1)(rng);
+    }
+    else
+    {
+        for (int a = G.altBegin[A]; a < G.altEnd[A]; a++)
+        {
+            if (G.altHeight[a] < G.altHeight[alt]) alt = a;
+        }
+    }
+    for (int k = 0; k < G.altLen[alt]; k++)
+    {
+        int sym = G.altSym[alt][k];
+        if (sym < 0) out += G.term[~sym];
+        else expand<G>(sym, depth - 1, rng, out);
+    }
+}
+
+template <const Grammar& G>
+class StaticEngine : public GrammarEngine
+{
+    static_assert(G.ok, "static_cfg::parse could not read the grammar (syntax, size limits, or a non-terminal without a terminating alternative)");
+
+public:
+    StaticEngine() : rng(std::random_device{}()) {}
+
+    bool isValidString(const std::string& input) override { return recognize<G>(input); }
+
+    std::string generateString(int maxDepth) override
+    {
+        std::string out;
+        expand<G>(G.start, maxDepth, rng, out);
+        return out;
+    }
+
+    const char* engineName() const override { return G.isLL1 ? "static LL(1)" : "static span table"; }
+
+private:
+    std::mt19937 rng;
+};
+
+} // namespace static_cfg
+
+#endif